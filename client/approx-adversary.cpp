@@ -0,0 +1,298 @@
+// Overload scenario for approx-server: hostile and broken connections next to
+// well-behaved -a players. Adversaries trickle bytes one at a time, never read
+// their socket, send endless lines without "\r\n" or never send HELLO; every
+// closed adversary connects again. The report (JSON on stdout) has the RTT
+// and throughput of the well-behaved players, how often the server closed
+// adversaries and, with -P, the server's peak RSS.
+
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../common/log.hpp"
+#include "../common/metrics.hpp"
+#include "../common/utils.hpp"
+#include "session.hpp"
+#include "utils-client.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+constexpr int64_t DEF_P = 0, MIN_P = 0, MAX_P = 65535;
+constexpr int64_t MAX_COUNT = 100000;  // connections of one kind
+constexpr int64_t DEF_C = 10;          // well-behaved players
+constexpr int64_t DEF_LINE = 1 << 20, MAX_LINE = 1ll << 34;
+constexpr int64_t DEF_I = 100, MIN_I = 1, MAX_I = 60000;    // trickle ms
+constexpr int64_t DEF_D = 1000, MIN_D = 0, MAX_D = 600000;  // warmup ms
+constexpr size_t CHUNK = 1 << 16;
+constexpr auto RSS_PERIOD = milliseconds(100);
+
+// One hostile connection. It reuses Client for connecting and buffering.
+struct Adversary : Client {
+  enum class Kind { TRICKLE, NO_READ, LONG_LINE, NO_HELLO };
+
+  Kind kind;
+  uint64_t line_bytes;  // LONG_LINE: bytes sent without "\r\n"
+  uint64_t sent = 0;
+  uint64_t connects = 0;
+  uint64_t closed_by_server = 0;
+
+  Adversary(Kind _kind, const string& id, const string& address,
+            uint16_t port, uint64_t _line_bytes)
+      : Client(id, address, port), kind(_kind), line_bytes(_line_bytes) {}
+
+  // returns -1 on error
+  int start(bool force_ipv4, bool force_ipv6) {
+    if (connect_to_server(force_ipv4, force_ipv6) < 0) {
+      return -1;
+    }
+    ++connects;
+    sent = 0;
+    int flags = fcntl(socket_fd, F_GETFL);
+    fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+    if (kind != Kind::NO_HELLO) {
+      string hello = "HELLO " + player_id + "\r\n";
+      if (kind == Kind::TRICKLE) {
+        pending = hello + "PUT 0 0\r\n";
+      } else {
+        write_all(hello);
+      }
+    }
+    return 0;
+  }
+
+  // Sends what this kind sends once per tick.
+  // returns 1 if the server closed the connection, 0 otherwise
+  int on_tick() {
+    ssize_t res = 0;
+    switch (kind) {
+      case Kind::TRICKLE:
+        if (pending.empty()) {
+          pending = "PUT 0 0\r\n";
+        }
+        if ((res = write(socket_fd, pending.data(), 1)) == 1) {
+          pending.erase(0, 1);
+        }
+        break;
+      case Kind::NO_READ: {
+        // As many PUTs as the socket takes, replies pile up on the server.
+        static const string flood = [] {
+          string all;
+          for (size_t i = 0; i < CHUNK / 9; ++i) {
+            all += "PUT 0 0\r\n";
+          }
+          return all;
+        }();
+        while ((res = write(socket_fd, flood.data(), flood.size())) > 0) {
+        }
+        break;
+      }
+      case Kind::LONG_LINE: {
+        static const string chunk(CHUNK, '1');
+        while (sent < line_bytes) {
+          size_t len = (size_t)min<uint64_t>(CHUNK, line_bytes - sent);
+          res = write(socket_fd, chunk.data(), len);
+          if (res <= 0) {
+            break;
+          }
+          sent += (uint64_t)res;
+        }
+        break;
+      }
+      case Kind::NO_HELLO:
+        break;
+    }
+    if (res < 0 and errno != EAGAIN and errno != EWOULDBLOCK) {
+      return closed();
+    }
+    return 0;
+  }
+
+  // Reads and drops whatever the server sent. NO_READ only polls for errors.
+  // returns 1 if the server closed the connection, 0 otherwise
+  int on_event(short revents) {
+    if (kind == Kind::NO_READ) {
+      return (revents & (POLLERR | POLLHUP)) ? closed() : 0;
+    }
+    ssize_t len;
+    while ((len = read(socket_fd, buffer.data(), buff_len)) > 0) {
+    }
+    if (len == 0 or (errno != EAGAIN and errno != EWOULDBLOCK)) {
+      return closed();
+    }
+    return 0;
+  }
+
+ private:
+  string pending;  // TRICKLE: bytes still to send
+
+  int closed() {
+    ++closed_by_server;
+    close(socket_fd);
+    return 1;
+  }
+
+  void write_all(const string& msg) {
+    if (write(socket_fd, msg.data(), msg.size()) < 0) {
+      print_error("cannot write to server: " + string(strerror(errno)));
+    }
+  }
+};
+
+// VmHWM (peak RSS) of the process in KB, 0 if unknown.
+long peak_rss_kb(int64_t pid) {
+  ifstream status("/proc/" + to_string(pid) + "/status");
+  string line;
+  while (getline(status, line)) {
+    if (line.rfind("VmHWM:", 0) == 0) {
+      return atol(line.c_str() + 6);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  map<char, char*> args;
+
+  if (argc % 2 != 1) {
+    print_error("every option must have a value.");
+    return 1;
+  }
+
+  unordered_set<string> valid_args = {"-s", "-p", "-c", "-T", "-R", "-B",
+                                      "-H", "-b", "-i", "-d", "-P"};
+
+  for (int i = 1; i < argc; i += 2) {
+    if (!valid_args.contains(argv[i])) {
+      print_error(string("invalid option ") + argv[i] + ".");
+      return 1;
+    }
+    if (args.contains(argv[i][1])) {
+      print_error(string("double parameter ") + argv[i] + ".");
+      return 1;
+    }
+    args[argv[i][1]] = argv[i + 1];
+  }
+  if (!check_mandatory_option(args, 's') or
+      !check_mandatory_option(args, 'p')) {
+    return 1;
+  }
+
+  int64_t port = get_arg('p', args, DEF_P, MIN_P, MAX_P);
+  int64_t good = get_arg('c', args, DEF_C, 0, MAX_COUNT);
+  int64_t counts[] = {get_arg('T', args, 0, 0, MAX_COUNT),
+                      get_arg('R', args, 0, 0, MAX_COUNT),
+                      get_arg('B', args, 0, 0, MAX_COUNT),
+                      get_arg('H', args, 0, 0, MAX_COUNT)};
+  int64_t line_bytes = get_arg('b', args, DEF_LINE, 1, MAX_LINE);
+  int64_t interval = get_arg('i', args, DEF_I, MIN_I, MAX_I);
+  int64_t warmup = get_arg('d', args, DEF_D, MIN_D, MAX_D);
+  int64_t server_pid = get_arg('P', args, 0, 1, INT32_MAX);
+  if (port < 0 or good < 0 or line_bytes < 0 or interval < 0 or
+      warmup < 0 or server_pid < 0 or
+      *min_element(begin(counts), end(counts)) < 0) {
+    return 1;
+  }
+  // Thousands of connections would only log that they connected.
+  log_configure("general=off,state=off,put=off");
+  raise_fd_limit();
+  signal(SIGPIPE, SIG_IGN);  // Writes to closed connections just fail
+  string address = args['s'];
+
+  vector<unique_ptr<Adversary>> adversaries;
+  const char* prefixes[] = {"TRICKLE", "NOREAD", "LONGLINE", "NOHELLO"};
+  for (size_t kind = 0; kind < 4; ++kind) {
+    for (int64_t i = 0; i < counts[kind]; ++i) {
+      adversaries.push_back(make_unique<Adversary>(
+          (Adversary::Kind)kind, prefixes[kind] + to_string(i), address,
+          (uint16_t)port, (uint64_t)line_bytes));
+    }
+  }
+
+  // The adversaries get one thread, ticking every -i milliseconds.
+  atomic<bool> stop{false};
+  long rss_kb = 0;
+  thread hostile([&] {
+    // Closed connections have fd -1, poll skips them.
+    vector<pollfd> fds(adversaries.size(), {-1, 0, 0});
+    auto next_rss = steady_clock::now();
+    while (!stop) {
+      for (size_t i = 0; i < adversaries.size(); ++i) {
+        Adversary& adversary = *adversaries[i];
+        if (fds[i].fd < 0) {
+          if (adversary.start(false, false) < 0) {
+            continue;
+          }
+          bool reads = adversary.kind != Adversary::Kind::NO_READ;
+          fds[i] = {adversary.socket_fd, (short)(reads ? POLLIN : 0), 0};
+        }
+        if (adversary.on_tick() == 1) {
+          fds[i].fd = -1;
+        }
+      }
+      if (poll(fds.data(), fds.size(), (int)interval) > 0) {
+        for (size_t i = 0; i < adversaries.size(); ++i) {
+          if (fds[i].revents != 0 and
+              adversaries[i]->on_event(fds[i].revents) == 1) {
+            fds[i].fd = -1;
+          }
+          fds[i].revents = 0;
+        }
+      }
+      if (server_pid > 0 and steady_clock::now() >= next_rss) {
+        rss_kb = peak_rss_kb(server_pid);
+        next_rss += RSS_PERIOD;
+      }
+    }
+    for (const pollfd& fd : fds) {
+      if (fd.fd >= 0) {
+        close(fd.fd);
+      }
+    }
+  });
+
+  this_thread::sleep_for(milliseconds(warmup));
+  LoadOptions options;
+  options.id_prefix = "GOOD";
+  options.server_address = address;
+  options.server_port = (uint16_t)port;
+  LoadStats stats;
+  auto start = steady_clock::now();
+  run_sessions(options, 0, 1, (size_t)good, stats);
+  double seconds = duration<double>(steady_clock::now() - start).count();
+  stop = true;
+  hostile.join();
+  if (server_pid > 0) {
+    rss_kb = peak_rss_kb(server_pid);
+  }
+
+  uint64_t connects = 0, closed = 0;
+  for (const auto& adversary : adversaries) {
+    connects += adversary->connects;
+    closed += adversary->closed_by_server;
+  }
+  log_flush();
+  cout << "{\"trickle\":" << counts[0] << ",\"no_read\":" << counts[1]
+       << ",\"long_line\":" << counts[2] << ",\"no_hello\":" << counts[3]
+       << ",\"adversary_connects\":" << connects
+       << ",\"adversary_closed_by_server\":" << closed
+       << ",\"good_players\":" << stats.sessions
+       << ",\"good_failed\":" << stats.failed << ",\"puts\":" << stats.puts
+       << ",\"seconds\":" << seconds
+       << ",\"puts_per_s\":" << (double)stats.puts / seconds
+       << ",\"rtt_us\":{\"p50\":" << stats.rtt.rtt_us.quantile(0.5)
+       << ",\"p90\":" << stats.rtt.rtt_us.quantile(0.9)
+       << ",\"p99\":" << stats.rtt.rtt_us.quantile(0.99)
+       << ",\"max\":" << stats.rtt.rtt_us.quantile(1)
+       << "},\"server_peak_rss_kb\":" << rss_kb << "}\n";
+  return stats.failed > 0 ? 1 : 0;
+}
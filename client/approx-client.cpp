@@ -1,30 +1,104 @@
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <thread>
 #include <unordered_set>
+#include <vector>
 
+#include "../common/log.hpp"
 #include "../common/utils.hpp"
+#include "session.hpp"
 #include "utils-client.hpp"
 
 using namespace std;
 
 constexpr uint64_t DEF_P = 0, MIN_P = 0, MAX_P = 65535;
+constexpr int64_t MIN_C = 1, MAX_C = 1000000;  // sessions
+constexpr int64_t DEF_J = 1, MIN_J = 1, MAX_J = 256;
+constexpr int64_t DEF_W = 0, MIN_W = 0, MAX_W = 3600000;  // think time ms
+constexpr int64_t DEF_M = 0, MIN_M = 0, MAX_M = INT32_MAX;  // PUT budget
+constexpr auto REPORT_CHECK = milliseconds(100);
+
+// -c: count sessions with ids <player_id>0, <player_id>1, ... spread over
+// threads, each with its own epoll loop.
+int run_load(const LoadOptions& options, size_t count, size_t threads) {
+  raise_fd_limit();
+  auto begin = steady_clock::now();
+  vector<LoadStats> thread_stats(threads);
+  vector<thread> workers;
+  vector<steady_clock::time_point> ends(threads);
+  atomic<size_t> finished{0};
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      run_sessions(options, t, threads, count, thread_stats[t]);
+      ends[t] = steady_clock::now();
+      ++finished;
+    });
+  }
+  // The RTT stats are atomics, read while the threads record to them.
+  while (finished < threads) {
+    exit_if_stop_requested();
+    if (rtt_report_requested) {
+      rtt_report_requested = 0;
+      RttStats rtt;
+      for (const LoadStats& part : thread_stats) {
+        rtt += part.rtt;
+      }
+      log_info(rtt.summary());
+    }
+    this_thread::sleep_for(REPORT_CHECK);
+  }
+  LoadStats stats;
+  for (size_t t = 0; t < threads; ++t) {
+    workers[t].join();
+    stats += thread_stats[t];
+  }
+  double seconds =
+      duration<double>(*max_element(ends.begin(), ends.end()) - begin)
+          .count();
+  log_info("Sessions: " + to_string(stats.sessions) + ", failed: " +
+           to_string(stats.failed) + ", games: " + to_string(stats.games) +
+           ", PUTs: " + to_string(stats.puts) + " in " +
+           to_string(seconds) + " s (" +
+           to_string((double)stats.puts / seconds) + " PUTs/s).");
+  log_info(stats.rtt.summary());
+  return stats.failed > 0 ? 1 : 0;
+}
 
 int main(int argc, char* argv[]) {
   map<char, char*> args;
 
-  unordered_set<string> valid_args = {"-u", "-s", "-p", "-4", "-6", "-a"};
+  unordered_set<string> valid_args = {"-u", "-s", "-p", "-4", "-6", "-a",
+                                     "-t", "-l", "-r", "-L",
+                                     "-c", "-j", "-w", "-m", "-U", "-M"};
 
   bool auto_strategy = false;
+  bool compact_scoring = false;
+  bool lobby = false;
+  bool measure = false;
   bool force_ipv4 = false, force_ipv6 = false;
 
   for (int i = 1; i < argc; i += 2) {
     string arg(argv[i]);
     if (!valid_args.contains(arg)) {
-      cout << "ERROR: invalid option " << arg << ".\n";
+      print_error("invalid option " + arg + ".");
       return 1;
     }
     if (arg == "-a") {
       auto_strategy = true;
       --i;
+    } else if (arg == "-t") {
+      compact_scoring = true;
+      --i;
+    } else if (arg == "-l") {
+      lobby = true;
+      --i;
+    } else if (arg == "-m") {
+      measure = true;
+      --i;
     } else if (arg == "-4") {
       force_ipv4 = true;
       --i;
@@ -32,24 +106,42 @@ int main(int argc, char* argv[]) {
       force_ipv6 = true;
       --i;
     } else if (args.contains(arg[1])) {
-      cout << "ERROR: double parameter " << arg << ".\n";
+      print_error("double parameter " + arg + ".");
       return 1;
     } else {
       args[arg[1]] = argv[i + 1];
     }
   }
 
+  if (args.contains('L') and log_configure(args['L']) < 0) {
+    print_error(string("invalid log setting ") + args['L'] + ".");
+    return 1;
+  }
+  if (args.contains('c') and !args.contains('L')) {
+    // Thousands of players would mostly log their states and PUTs.
+    log_configure("state=off,put=off");
+  }
+
+  // The end of the log is still in memory, so I stop at the next poll.
+  signal(SIGINT, [](int sig) { stop_requested = sig; });
+  signal(SIGTERM, [](int sig) { stop_requested = sig; });
+  if (measure) {
+    signal(SIGUSR1, [](int) { rtt_report_requested = 1; });
+  }
+
   if (force_ipv4 and force_ipv6) {
     force_ipv4 = force_ipv6 = false;
   }
 
   string player_id;
   string server_address;
-  int32_t port;
+  int32_t port = 0;
+  string unix_path;
 
+  // With -U the server is reached by its AF_UNIX socket, not an address.
   if (!check_mandatory_option(args, 'u') ||
-      !check_mandatory_option(args, 's') ||
-      !check_mandatory_option(args, 'p')) {
+      (!args.contains('U') and (!check_mandatory_option(args, 's') ||
+                                !check_mandatory_option(args, 'p')))) {
     return 1;
   }
 
@@ -59,10 +151,54 @@ int main(int argc, char* argv[]) {
     print_error("invalid player ID '" + player_id + "'.");
     return 1;
   }
-  server_address = args['s'];
-  port = (int32_t)get_arg('p', args, DEF_P, MIN_P, MAX_P);
+  if (args.contains('U')) {
+    unix_path = args['U'];
+  } else {
+    server_address = args['s'];
+    port = (int32_t)get_arg('p', args, DEF_P, MIN_P, MAX_P);
+    if (port < 0) {
+      return 1;
+    }
+  }
+
+  int64_t room = -1;
+  if (args.contains('r')) {
+    room = get_arg('r', args, 0, 0, INT32_MAX);
+    if (room < 0) {
+      return 1;
+    }
+  }
+
+  if (args.contains('c')) {
+    int64_t count = get_arg('c', args, MIN_C, MIN_C, MAX_C);
+    int64_t threads = get_arg('j', args, DEF_J, MIN_J, MAX_J);
+    int64_t think_ms = get_arg('w', args, DEF_W, MIN_W, MAX_W);
+    if (count < 0 or threads < 0 or think_ms < 0) {
+      return 1;
+    }
+    LoadOptions options{player_id,       server_address, (uint16_t)port,
+                        unix_path,       force_ipv4,     force_ipv6,
+                        compact_scoring, room,           lobby,
+                        milliseconds(think_ms)};
+    return run_load(options, (size_t)count, (size_t)threads);
+  }
 
   Client client(player_id, server_address, (uint16_t)port);
+  client.unix_path = unix_path;
+  client.compact_scoring = compact_scoring;
+  client.room = room;
+  RttStats rtt;
+  if (measure) {
+    client.rtt = &rtt;
+  }
+  if (auto_strategy) {
+    int64_t budget = get_arg('M', args, DEF_M, MIN_M, MAX_M);
+    if (budget < 0) {
+      return 1;
+    }
+    client.strategy =
+        make_unique<PlannerStrategy>(client.state_delay(), (uint64_t)budget);
+  }
 
   if (client.connect_to_server(force_ipv4, force_ipv6) < 0) {
     return 1;
@@ -72,21 +208,32 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  if (auto_strategy) {
-    int res = client.auto_play();
-    close(client.fds[1].fd);
-    if (res < 0) {
-      return 1;
-    }
-  } else {
-    if (client.setup_stdin() < 0) {
-      return 1;
+  if (!auto_strategy and client.setup_stdin() < 0) {
+    return 1;
+  }
+  auto play = [&]() {
+    return auto_strategy ? client.auto_play() : client.interactive_play();
+  };
+
+  auto report = [&]() {
+    if (measure) {
+      log_info(rtt.summary());
     }
-    int res = client.interactive_play();
-    close(client.fds[1].fd);
-    if (res < 0) {
-      return 1;
+  };
+
+  int res = play();
+  report();
+  // In lobby mode the server keeps the connection and starts the next game.
+  while (lobby and res >= 0 and !client.server_closed) {
+    res = client.start_next_game();
+    if (res == 0) {
+      res = play();
+      report();
     }
   }
+  close(client.fds[1].fd);
+  if (res < 0) {
+    return 1;
+  }
   return 0;
 }
\ No newline at end of file
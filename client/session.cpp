@@ -0,0 +1,336 @@
+#include "session.hpp"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include <memory>
+#include <queue>
+#include <vector>
+
+#include "../common/log.hpp"
+#include "../common/utils.hpp"
+
+constexpr int MAX_EVENTS = 1024;
+// Connects in progress at a time in one loop.
+constexpr size_t MAX_CONNECTING = 256;
+// Wait before the next connect when the AF_UNIX backlog is full.
+constexpr int CONNECT_RETRY_MS = 1;
+
+// Session
+
+int Session::start_connect(const sockaddr* addr, socklen_t addr_len) {
+  socket_fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (socket_fd < 0) {
+    print_error("cannot create socket: " + string(strerror(errno)));
+    return -1;
+  }
+  if (connect(socket_fd, addr, addr_len) < 0 and errno != EINPROGRESS) {
+    int error = errno;
+    close(socket_fd);
+    socket_fd = -1;
+    // The backlog of an AF_UNIX listener is full.
+    if (error == EAGAIN) {
+      return 1;
+    }
+    print_error("cannot connect to server: " + string(strerror(error)));
+    return -1;
+  }
+  fds[1].fd = socket_fd;
+  fds[1].events = POLLIN | POLLOUT;
+  fds[1].revents = 0;
+  connecting = true;
+  return 0;
+}
+
+int Session::on_connected() {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+    error = errno;
+  }
+  if (error != 0) {
+    print_error("cannot connect to server: " + string(strerror(error)));
+    return -1;
+  }
+  connecting = false;
+  if (unix_path.empty()) {
+    log_info("Connected to [" + server_ip + "]:" + to_string(server_port));
+  } else {
+    log_info("Connected to " + unix_path);
+  }
+  return send_hello();
+}
+
+int Session::on_readable() {
+  int res = Client::on_readable();
+  while (res == 1) {
+    if (!server_closed) {
+      ++games;
+    }
+    if (!lobby or server_closed) {
+      return 1;
+    }
+    // The next game may have started in the same read.
+    res = advance(start_next_game());
+  }
+  return res;
+}
+
+// LoadStats
+
+LoadStats& LoadStats::operator+=(const LoadStats& other) {
+  sessions += other.sessions;
+  failed += other.failed;
+  games += other.games;
+  puts += other.puts;
+  rtt += other.rtt;
+  return *this;
+}
+
+// Event loop
+
+void raise_fd_limit() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 and
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+// The server address, resolved once for all the sessions of a loop.
+struct Target {
+  sockaddr_storage addr{};
+  socklen_t len = 0;
+  string ip;  // Numeric, empty for AF_UNIX
+};
+
+// Thousands of sessions connect to one server, so they skip Happy Eyeballs
+// and all take the first address of the resolver.
+// returns -1 on error
+static int resolve_target(const LoadOptions& options, Target& target) {
+  if (!options.unix_path.empty()) {
+    sockaddr_un* addr = (sockaddr_un*)&target.addr;
+    if (options.unix_path.size() >= sizeof(addr->sun_path)) {
+      print_error("socket path is too long: " + options.unix_path);
+      return -1;
+    }
+    addr->sun_family = AF_UNIX;
+    options.unix_path.copy(addr->sun_path, options.unix_path.size());
+    target.len = sizeof(sockaddr_un);
+    return 0;
+  }
+  addrinfo hints{};
+  addrinfo* res;
+  hints.ai_family = options.force_ipv4   ? AF_INET
+                    : options.force_ipv6 ? AF_INET6
+                                         : AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  int ret = getaddrinfo(options.server_address.c_str(),
+                        to_string(options.server_port).c_str(), &hints, &res);
+  if (ret != 0) {
+    print_error("getaddrinfo failed: " + string(gai_strerror(ret)));
+    return -1;
+  }
+  memcpy(&target.addr, res->ai_addr, res->ai_addrlen);
+  target.len = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  char ip_str[INET6_ADDRSTRLEN];
+  const void* ip =
+      target.addr.ss_family == AF_INET
+          ? (const void*)&((const sockaddr_in*)&target.addr)->sin_addr
+          : (const void*)&((const sockaddr_in6*)&target.addr)->sin6_addr;
+  if (inet_ntop(target.addr.ss_family, ip, ip_str, sizeof(ip_str)) == NULL) {
+    print_error("inet_ntop failed: " + string(strerror(errno)));
+    return -1;
+  }
+  target.ip = ip_str;
+  return 0;
+}
+
+void run_sessions(const LoadOptions& options, size_t first, size_t step,
+                  size_t count, LoadStats& stats) {
+  Target target;
+  int epoll_fd = -1;
+  if (resolve_target(options, target) == 0) {
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+      print_error("epoll_create1 failed: " + string(strerror(errno)));
+    }
+  }
+  if (epoll_fd < 0) {
+    for (size_t i = first; i < count; i += step) {
+      ++stats.sessions;
+      ++stats.failed;
+    }
+    return;
+  }
+
+  vector<unique_ptr<Session>> sessions;
+  vector<bool> writing;  // EPOLLOUT is registered for the session
+  size_t active = 0;
+  size_t connecting = 0;
+  size_t next_id = first;
+
+  auto update_events = [&](size_t i) {
+    Session& session = *sessions[i];
+    bool want = !session.messages_to_send.empty();
+    if (want != writing[i]) {
+      epoll_event event{};
+      event.events = EPOLLIN;
+      if (want) {
+        event.events |= EPOLLOUT;
+      }
+      event.data.u64 = i;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session.socket_fd, &event);
+      writing[i] = want;
+    }
+  };
+  auto finish = [&](size_t i, bool failed) {
+    Session& session = *sessions[i];
+    if (session.connecting) {
+      session.connecting = false;
+      --connecting;
+    }
+    session.phase = Session::Phase::DONE;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session.socket_fd, NULL);
+    close(session.socket_fd);
+    stats.failed += failed;
+    --active;
+  };
+  // Starts the connect of the next session.
+  // returns false if it is to be tried again later
+  auto start_next = [&]() {
+    auto session =
+        make_unique<Session>(options.id_prefix + to_string(next_id),
+                             options.server_address, options.server_port);
+    session->unix_path = options.unix_path;
+    session->server_ip = target.ip;
+    session->compact_scoring = options.compact_scoring;
+    session->room = options.room;
+    session->lobby = options.lobby;
+    session->think_time = options.think_time;
+    session->rtt = &stats.rtt;
+    int res = session->start_connect((const sockaddr*)&target.addr,
+                                     target.len);
+    if (res == 1) {
+      return false;
+    }
+    next_id += step;
+    ++stats.sessions;
+    if (res < 0) {
+      ++stats.failed;
+      return true;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT;  // EPOLLOUT tells the connect is done
+    event.data.u64 = sessions.size();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->socket_fd, &event) < 0) {
+      print_error("epoll_ctl failed: " + string(strerror(errno)));
+      close(session->socket_fd);
+      ++stats.failed;
+      return true;
+    }
+    sessions.push_back(move(session));
+    writing.push_back(true);
+    ++active;
+    ++connecting;
+    return true;
+  };
+
+  // Scheduled PUTs of sessions with a think time, the earliest first.
+  using Timer = pair<steady_clock::time_point, size_t>;
+  priority_queue<Timer, vector<Timer>, greater<Timer>> timers;
+  epoll_event events[MAX_EVENTS];
+
+  while (active > 0 or next_id < count) {
+    exit_if_stop_requested();
+    // Connects start as earlier ones complete, so the sessions that are
+    // connected already send HELLO and play meanwhile.
+    bool backlog_full = false;
+    while (next_id < count and connecting < MAX_CONNECTING and
+           !backlog_full) {
+      backlog_full = !start_next();
+    }
+    int timeout = -1;
+    if (!timers.empty()) {
+      auto wait = timers.top().first - steady_clock::now();
+      timeout = (int)max<int64_t>(0, ceil<milliseconds>(wait).count());
+    }
+    if (backlog_full and (timeout < 0 or timeout > CONNECT_RETRY_MS)) {
+      timeout = CONNECT_RETRY_MS;
+    }
+    int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if (n_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      print_error("epoll_wait failed: " + string(strerror(errno)));
+      break;
+    }
+
+    for (int e = 0; e < n_events; ++e) {
+      size_t i = events[e].data.u64;
+      Session& session = *sessions[i];
+      if (session.phase == Session::Phase::DONE) {
+        continue;
+      }
+      if (session.connecting) {
+        if (session.on_connected() < 0) {
+          finish(i, true);
+          continue;
+        }
+        --connecting;
+        session.on_writable();  // HELLO
+        update_events(i);
+        continue;
+      }
+      if (events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        bool was_scheduled = session.put_scheduled;
+        int res = session.on_readable();
+        if (res != 0) {
+          finish(i, res < 0);
+          continue;
+        }
+        if (!was_scheduled and session.put_scheduled) {
+          timers.push({session.next_put, i});
+        }
+      }
+      if (events[e].events & EPOLLOUT) {
+        session.on_writable();
+      }
+      update_events(i);
+    }
+
+    auto now = steady_clock::now();
+    while (!timers.empty() and timers.top().first <= now) {
+      size_t i = timers.top().second;
+      timers.pop();
+      Session& session = *sessions[i];
+      if (session.phase != Session::Phase::DONE) {
+        auto scheduled_at = session.next_put;
+        session.on_timer(now);
+        // A strategy that sends before the reply may schedule the next PUT.
+        if (session.put_scheduled and session.next_put != scheduled_at) {
+          timers.push({session.next_put, i});
+        }
+        update_events(i);
+      }
+    }
+  }
+
+  for (; next_id < count; next_id += step) {
+    ++stats.sessions;
+    ++stats.failed;
+  }
+  for (size_t i = 0; i < sessions.size(); ++i) {
+    if (sessions[i]->phase != Session::Phase::DONE) {
+      finish(i, true);
+    }
+    stats.games += sessions[i]->games;
+    stats.puts += sessions[i]->puts;
+  }
+  close(epoll_fd);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "utils-client.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// Many auto-play connections in one process (approx-client -c), each of them
+// a Session driven by an epoll loop instead of blocking polls.
+
+// One -a player on a non-blocking socket.
+struct Session : Client {
+  bool lobby = false;
+  bool connecting = false;  // The connect is in progress
+  uint64_t games = 0;
+
+  using Client::Client;
+
+  // Starts a non-blocking connect to addr, on_connected follows on EPOLLOUT.
+  // returns -1 on error, 1 if it is to be tried again later, 0 otherwise
+  int start_connect(const sockaddr* addr, socklen_t addr_len);
+  // Checks the result of the connect and queues HELLO.
+  // returns -1 on error
+  int on_connected();
+  // Client::on_readable, then the next games in lobby mode.
+  // returns -1 on error, 1 if the session is done, 0 otherwise
+  int on_readable();
+};
+
+struct LoadStats {
+  uint64_t sessions = 0;
+  uint64_t failed = 0;  // Sessions that could not connect or got an error
+  uint64_t games = 0;
+  uint64_t puts = 0;
+  RttStats rtt;
+
+  LoadStats& operator+=(const LoadStats& other);
+};
+
+struct LoadOptions {
+  string id_prefix;  // Session i uses id_prefix + i
+  string server_address;
+  uint16_t server_port;
+  string unix_path;  // Instead of the address if not empty
+  bool force_ipv4 = false;
+  bool force_ipv6 = false;
+  bool compact_scoring = false;
+  int64_t room = -1;
+  bool lobby = false;
+  milliseconds think_time{0};
+};
+
+// Raises the soft limit of open files to the hard one, one socket per session.
+void raise_fd_limit();
+
+// Runs sessions first, first + step, ... < count on one epoll loop until all
+// of them are done, counting them in stats.
+void run_sessions(const LoadOptions& options, size_t first, size_t step,
+                  size_t count, LoadStats& stats);
@@ -0,0 +1,142 @@
+#include "strategy.hpp"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "../common/log.hpp"
+#include "../common/utils.hpp"
+
+namespace {
+
+// Values of the polynomial with coefficients at 0, 1, ..., k.
+vector<double> goal_values(const vector<double> &coefficients, int32_t k) {
+  vector<double> values((size_t)k + 1);
+  for (size_t i = 0; i < values.size(); ++i) {
+    double power = 1.0;
+    for (double coeff : coefficients) {
+      values[i] += coeff * power;
+      power *= (double)i;
+    }
+  }
+  return values;
+}
+
+}  // namespace
+
+// GreedyPlan
+void GreedyPlan::start(const vector<double> &coefficients, int32_t k,
+                       double first) {
+  val_que = {};
+  vector<double> values = goal_values(coefficients, k);
+  values[0] -= first;
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (values[i] != 0) {
+      val_que.push({{fabs(values[i]), values[i]}, (int32_t)i});
+    }
+  }
+}
+
+pair<int32_t, double> GreedyPlan::next() {
+  if (val_que.empty()) {
+    return {0, 0};
+  }
+  auto values = val_que.top();
+  val_que.pop();
+  if (values.first.first > MAX_PUT_VALUE) {
+    double val = values.first.second < 0 ? -MAX_PUT_VALUE : MAX_PUT_VALUE;
+    values.first.first -= fabs(val);
+    values.first.second -= val;
+    val_que.push(values);
+    return {values.second, val};
+  }
+  return {values.second, values.first.second};
+}
+
+// PlannerStrategy
+double PlannerStrategy::first_value(const vector<double> &coefficients) {
+  // A new game.
+  started = last_sent = last_reply = steady_clock::now();
+  reached = {};
+  planned = replies = penalties = reached_puts = 0;
+  first = clamp(coefficients.empty() ? 0.0 : coefficients[0], -MAX_PUT_VALUE,
+                MAX_PUT_VALUE);
+  return first;
+}
+
+void PlannerStrategy::start(const vector<double> &coefficients, int32_t k) {
+  plan.start(coefficients, k, first);
+  goal = goal_values(coefficients, k);
+  if (approx.size() != goal.size()) {
+    approx.assign(goal.size(), 0.0);
+    approx[0] = first;
+  }
+
+  // The same steps on a copy, up to the budget.
+  GreedyPlan rest = plan;
+  planned = 1;
+  while (!rest.val_que.empty() and (budget == 0 or planned < budget)) {
+    rest.next();
+    ++planned;
+  }
+  planned_error = 0;
+  for (auto queue = rest.val_que; !queue.empty(); queue.pop()) {
+    planned_error += queue.top().first.second * queue.top().first.second;
+  }
+  // The round trip of the first PUT, without the delay of its STATE.
+  steady_clock::duration network = last_reply - last_sent - state_delay;
+  network = max(network, steady_clock::duration{0});
+  auto cycle = duration<double>(state_delay + network).count();
+  planned_s = duration<double>(last_reply - started).count() +
+              (double)(planned - 1) * cycle;
+  log_info("Plan: error " + to_string(planned_error) + " after " +
+           to_string(planned) + " PUTs in " + to_string(planned_s) +
+           " s, " + to_string(cycle) + " s per PUT.");
+}
+
+void PlannerStrategy::on_reply(const string &msg) {
+  last_reply = steady_clock::now();
+  ++replies;
+  if (msg.starts_with("PENALTY ")) {
+    ++penalties;
+  } else if (msg.starts_with("STATE ")) {
+    string state = msg;
+    approx = parse_coefficients(state);
+  }
+  if (replies == planned and reached == steady_clock::time_point{}) {
+    reached = last_reply;
+    reached_puts = replies;
+    achieved_error = error();
+  }
+}
+
+void PlannerStrategy::finish() {
+  if (planned == 0) {
+    // The game ended before the reply to the first PUT, so before start.
+    log_info("Game ended before the plan was made (" + to_string(replies) +
+             " replies, " + to_string(penalties) + " penalties).");
+  } else {
+    if (reached == steady_clock::time_point{}) {
+      // The game ended before the plan did.
+      reached = last_reply;
+      reached_puts = replies;
+      achieved_error = error();
+    }
+    log_info("Planned error " + to_string(planned_error) + " after " +
+             to_string(planned) + " PUTs in " + to_string(planned_s) +
+             " s, achieved " + to_string(achieved_error) + " after " +
+             to_string(reached_puts) + " PUTs in " +
+             to_string(duration<double>(reached - started).count()) +
+             " s (" + to_string(penalties) + " penalties).");
+  }
+  approx.clear();
+  planned = replies = penalties = 0;  // Until the next game starts
+}
+
+double PlannerStrategy::error() const {
+  double res = PENALTY_POINTS * (double)penalties;
+  for (size_t i = 0; i < goal.size() and i < approx.size(); ++i) {
+    res += (goal[i] - approx[i]) * (goal[i] - approx[i]);
+  }
+  return res;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../common/rules.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+// How an auto-play client picks its PUTs. The event loop of the client asks
+// for the next PUT right after writing one, so the strategy works while the
+// reply is on its way, and sends it as soon as may_send allows.
+struct Strategy {
+  virtual ~Strategy() = default;
+
+  // Value of the PUT that tells k, at point 0, the only point known to exist
+  // before it.
+  virtual double first_value(const vector<double> &) { return 0; }
+  // A new game: the coefficients and k, known from the STATE of PUT 0 0.
+  virtual void start(const vector<double> &coefficients, int32_t k) = 0;
+  // Point and value of the next PUT.
+  virtual pair<int32_t, double> next() = 0;
+  // Whether the next PUT may go out while in_flight PUTs are unanswered.
+  virtual bool may_send(size_t in_flight) const { return in_flight == 0; }
+  // One of the PUTs was written completely.
+  virtual void on_sent(steady_clock::time_point) {}
+  // A STATE, PENALTY or BAD_PUT for one of the PUTs.
+  virtual void on_reply(const string &) {}
+  // The game ended, in any phase of the client (even before start).
+  virtual void finish() {}
+};
+
+// The -a strategy: the biggest remaining difference first, in steps of at
+// most 5, then PUT 0 0 until the game ends.
+struct GreedyPlan {
+  using el = pair<pair<double, double>, int32_t>;
+  priority_queue<el, vector<el>, less<el>> val_que;
+
+  // Goal values at 0, 1, ..., k of the polynomial with coefficients, less
+  // first at point 0. Points already right are left out.
+  void start(const vector<double> &coefficients, int32_t k, double first = 0);
+  // Point and value of the next PUT.
+  pair<int32_t, double> next();
+};
+
+struct GreedyStrategy : Strategy {
+  GreedyPlan plan;
+
+  void start(const vector<double> &coefficients, int32_t k) override {
+    plan.start(coefficients, k);
+  }
+  pair<int32_t, double> next() override { return plan.next(); }
+};
+
+// The -a strategy of approx-client, which plans with the rules of the server.
+// A PUT sent before the reply to the previous one is not applied and costs
+// PENALTY_POINTS, so it never lowers the error, and it could only save the
+// way back of the reply, which the client can't measure: the planner waits
+// for every reply, and a PUT costs state_delay plus the round trip. Per PUT
+// the biggest remaining difference lowers the error the most, so GreedyPlan's
+// order is the best for any number of PUTs. The first PUT already makes a
+// step at point 0 instead of PUT 0 0, so the plan is also one cycle shorter.
+// At the end of a game it logs the planned and achieved error and time.
+struct PlannerStrategy : Strategy {
+  seconds state_delay;
+  uint64_t budget;  // Most PUTs planned for (the share of m), 0: until error 0
+  GreedyPlan plan;
+  vector<double> goal, approx;  // approx from the last STATE
+  double first = 0;
+
+  uint64_t planned = 0;  // PUTs of the plan, the first one too
+  double planned_error = 0;
+  double planned_s = 0;
+  steady_clock::time_point started, last_sent, last_reply, reached;
+  uint64_t replies = 0, penalties = 0, reached_puts = 0;
+  double achieved_error = 0;
+
+  PlannerStrategy(seconds _state_delay, uint64_t _budget)
+      : state_delay(_state_delay), budget(_budget) {}
+
+  double first_value(const vector<double> &coefficients) override;
+  void start(const vector<double> &coefficients, int32_t k) override;
+  pair<int32_t, double> next() override { return plan.next(); }
+  void on_sent(steady_clock::time_point now) override { last_sent = now; }
+  void on_reply(const string &msg) override;
+  void finish() override;
+
+ private:
+  // Squared differences of the last STATE plus the penalties.
+  double error() const;
+};
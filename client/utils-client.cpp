@@ -1,16 +1,34 @@
 #include "utils-client.hpp"
 
-#include <math.h>
-
 #include <algorithm>
 #include <map>
 #include <queue>
+#include <sstream>
 
+#include "../common/log.hpp"
 #include "../common/utils.hpp"
 
+volatile sig_atomic_t rtt_report_requested = 0;
+volatile sig_atomic_t stop_requested = 0;
+
+// Formats like cout << val.
+static string format_double(double val) {
+  ostringstream out;
+  out << val;
+  return out.str();
+}
+
+void exit_if_stop_requested() {
+  if (stop_requested) {
+    log_flush();
+    // Other threads may be playing still, so I skip the destructors.
+    _exit(128 + stop_requested);
+  }
+}
+
 bool check_mandatory_option(const map<char, char *> &args, char option) {
   if (!args.contains(option)) {
-    cout << "ERROR: option -" << option << " is mandatory.\n";
+    print_error(string("option -") + option + " is mandatory.");
     return false;
   }
   return true;
@@ -61,8 +79,10 @@ bool valid_coeff(string &msg) {
 
 // ClientMessageQueue
 void ClientMessageQueue::push(const string &msg) { messages.push(msg); }
-bool ClientMessageQueue::empty() const { return messages.empty(); }
-void ClientMessageQueue::send_message(int socket_fd) {
+bool ClientMessageQueue::empty() const {
+  return messages.empty() and current_message.empty();
+}
+bool ClientMessageQueue::send_message(int socket_fd) {
   if (current_message.empty()) {
     current_message = messages.front();
     messages.pop();
@@ -72,14 +92,56 @@ void ClientMessageQueue::send_message(int socket_fd) {
   ssize_t bytes_sent = write(socket_fd, current_message.c_str() + current_pos,
                              current_message.size() - current_pos);
   if (bytes_sent < 0) {
+    if (errno == EAGAIN or errno == EWOULDBLOCK) {
+      return false;  // The socket buffer is full, we try again on POLLOUT.
+    }
     print_error("senging message failed: " + string(strerror(errno)));
-    return;
+    return false;
   }
   current_pos += (size_t)bytes_sent;
   if (current_pos == current_message.size()) {
+    sent_message.swap(current_message);
     current_message.clear();
     current_pos = 0;
+    return true;
   }
+  return false;
+}
+
+// RttStats
+RttStats &RttStats::operator+=(const RttStats &other) {
+  rtt_us.merge(other.rtt_us);
+  extra_us.merge(other.extra_us);
+  uint64_t other_replies = other.replies.get();
+  replies.add(other_replies);
+  if (other_replies > 0) {
+    auto other_first = other.first_put.load(memory_order_relaxed);
+    if (replies.get() == other_replies or
+        other_first < first_put.load(memory_order_relaxed)) {
+      first_put.store(other_first, memory_order_relaxed);
+    }
+    last_reply.store(max(last_reply.load(memory_order_relaxed),
+                         other.last_reply.load(memory_order_relaxed)),
+                     memory_order_relaxed);
+  }
+  return *this;
+}
+
+string RttStats::summary() const {
+  double seconds = duration<double>(last_reply.load(memory_order_relaxed) -
+                                    first_put.load(memory_order_relaxed))
+                       .count();
+  uint64_t n_replies = replies.get();
+  auto percentiles = [](const Histogram &histogram) {
+    return "p50 " + to_string(histogram.quantile(0.5)) + " us, p90 " +
+           to_string(histogram.quantile(0.9)) + " us, p99 " +
+           to_string(histogram.quantile(0.99)) + " us, max " +
+           to_string(histogram.quantile(1)) + " us";
+  };
+  return "RTT of " + to_string(n_replies) + " PUTs: " + percentiles(rtt_us) +
+         "; without server delays: " + percentiles(extra_us) + "; " +
+         to_string(seconds > 0 ? (double)n_replies / seconds : 0.0) +
+         " PUTs/s.";
 }
 
 // Client
@@ -99,7 +161,52 @@ int Client::setup_stdin() {
   return 0;
 }
 
+// RFC 8305: the next address is tried when the previous attempt did not
+// succeed or fail in this time.
+constexpr milliseconds CONNECTION_ATTEMPT_DELAY{250};
+
+// Numeric address of an AF_INET or AF_INET6 sockaddr, empty on error.
+static string address_string(const sockaddr *addr) {
+  char ip_str[INET6_ADDRSTRLEN];
+  const void *ip = addr->sa_family == AF_INET
+                       ? (const void *)&((const sockaddr_in *)addr)->sin_addr
+                       : (const void *)&((const sockaddr_in6 *)addr)->sin6_addr;
+  if (inet_ntop(addr->sa_family, ip, ip_str, sizeof(ip_str)) == NULL) {
+    return "";
+  }
+  return ip_str;
+}
+
+// The addresses alternating between the families, IPv6 first, otherwise in
+// the order of the resolver.
+static vector<const addrinfo *> interleave_families(const addrinfo *res) {
+  vector<const addrinfo *> first, second;
+  for (const addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    if (ai->ai_family != AF_INET and ai->ai_family != AF_INET6) {
+      continue;
+    }
+    bool is_first = first.empty() or ai->ai_family == first[0]->ai_family;
+    (is_first ? first : second).push_back(ai);
+  }
+  if (!first.empty() and first[0]->ai_family == AF_INET and !second.empty()) {
+    swap(first, second);  // IPv6 leads
+  }
+  vector<const addrinfo *> order;
+  for (size_t i = 0; i < max(first.size(), second.size()); ++i) {
+    if (i < first.size()) {
+      order.push_back(first[i]);
+    }
+    if (i < second.size()) {
+      order.push_back(second[i]);
+    }
+  }
+  return order;
+}
+
 int Client::connect_to_server(bool force_ipv4, bool force_ipv6) {
+  if (!unix_path.empty()) {
+    return connect_to_unix();
+  }
   addrinfo hints{};
   addrinfo *res;
 
@@ -107,6 +214,7 @@ int Client::connect_to_server(bool force_ipv4, bool force_ipv6) {
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_protocol = IPPROTO_TCP;
 
+  auto start = steady_clock::now();
   int ret = getaddrinfo(server_address.c_str(), to_string(server_port).c_str(),
                         &hints, &res);
 
@@ -114,17 +222,87 @@ int Client::connect_to_server(bool force_ipv4, bool force_ipv6) {
     print_error("getaddrinfo failed: " + string(gai_strerror(ret)));
     return -1;
   }
+  auto resolved = steady_clock::now();
+
+  // Happy Eyeballs: non-blocking connects race, a new one starts every
+  // CONNECTION_ATTEMPT_DELAY or as soon as one fails, the first to succeed
+  // wins.
+  vector<const addrinfo *> order = interleave_families(res);
+  vector<pollfd> attempts;
+  vector<const addrinfo *> attempt_addr;
+  size_t next = 0;
+  auto next_attempt = resolved;
+  int last_error = 0;
+  const addrinfo *winner = NULL;
+  socket_fd = -1;
+  while (winner == NULL and (next < order.size() or !attempts.empty())) {
+    auto now = steady_clock::now();
+    if (next < order.size() and (now >= next_attempt or attempts.empty())) {
+      const addrinfo *ai = order[next++];
+      int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      if (fd < 0) {
+        last_error = errno;
+        continue;
+      }
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 and
+          errno != EINPROGRESS) {
+        last_error = errno;
+        close(fd);
+        continue;
+      }
+      attempts.push_back({fd, POLLOUT, 0});
+      attempt_addr.push_back(ai);
+      next_attempt = steady_clock::now() + CONNECTION_ATTEMPT_DELAY;
+      continue;  // It may have connected at once, poll tells.
+    }
+    int timeout = -1;
+    if (next < order.size()) {
+      timeout = (int)max<int64_t>(
+          0, duration_cast<milliseconds>(next_attempt - now).count());
+    }
+    if (poll(attempts.data(), (nfds_t)attempts.size(), timeout) < 0) {
+      if (errno == EINTR) {
+        exit_if_stop_requested();
+        continue;
+      }
+      last_error = errno;
+      break;
+    }
+    for (size_t i = 0; i < attempts.size();) {
+      if (attempts[i].revents == 0) {
+        ++i;
+        continue;
+      }
+      int error = 0;
+      socklen_t len = sizeof(error);
+      getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &len);
+      if (error == 0 and winner == NULL) {
+        socket_fd = attempts[i].fd;
+        winner = attempt_addr[i];
+      } else {
+        last_error = error;
+        close(attempts[i].fd);
+        // A failed attempt lets the next one start right away.
+        next_attempt = steady_clock::now();
+      }
+      attempts.erase(attempts.begin() + (ptrdiff_t)i);
+      attempt_addr.erase(attempt_addr.begin() + (ptrdiff_t)i);
+    }
+  }
+  for (const pollfd &attempt : attempts) {
+    close(attempt.fd);  // Lost the race
+  }
 
-  socket_fd = socket(res->ai_family, SOCK_STREAM, 0);
-  if (socket_fd < 0) {
-    print_error("cannot create socket: " + string(strerror(errno)));
+  if (winner == NULL) {
+    print_error("cannot connect to server: " +
+                string(strerror(last_error != 0 ? last_error : ENOENT)));
     freeaddrinfo(res);
     return -1;
   }
-
-  ret = connect(socket_fd, res->ai_addr, res->ai_addrlen);
-  if (ret < 0) {
-    print_error("cannot connect to server: " + string(strerror(errno)));
+  // The rest of the client expects a blocking socket.
+  int flags = fcntl(socket_fd, F_GETFL);
+  if (flags < 0 or fcntl(socket_fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+    print_error("Cannot set socket to blocking: " + string(strerror(errno)));
     freeaddrinfo(res);
     close(socket_fd);
     return -1;
@@ -134,35 +312,64 @@ int Client::connect_to_server(bool force_ipv4, bool force_ipv6) {
   fds[1].events = POLLIN | POLLOUT;
   fds[1].revents = 0;
 
-  if (res->ai_family == AF_INET) {
-    sockaddr_in *ipv4 = (sockaddr_in *)res->ai_addr;
-    char ip_str[INET_ADDRSTRLEN];
-    if (inet_ntop(AF_INET, &ipv4->sin_addr, ip_str, sizeof(ip_str)) == NULL) {
-      print_error("inet_ntop failed: " + string(strerror(errno)));
-      freeaddrinfo(res);
-      close(socket_fd);
-      return -1;
-    }
-    server_ip = string(ip_str);
-  } else {
-    sockaddr_in6 *ipv6 = (sockaddr_in6 *)res->ai_addr;
-    char ip_str[INET6_ADDRSTRLEN];
-    if (inet_ntop(AF_INET6, &ipv6->sin6_addr, ip_str, sizeof(ip_str)) == NULL) {
-      print_error("inet_ntop failed: " + string(strerror(errno)));
-      freeaddrinfo(res);
-      close(socket_fd);
-      return -1;
-    }
-    server_ip = string(ip_str);
+  server_ip = address_string(winner->ai_addr);
+  if (server_ip.empty()) {
+    print_error("inet_ntop failed: " + string(strerror(errno)));
+    freeaddrinfo(res);
+    close(socket_fd);
+    return -1;
   }
 
-  cout << "Connected to [" << server_ip << "]:" << server_port << endl;
+  auto us = [](steady_clock::duration d) {
+    return to_string(duration_cast<microseconds>(d).count()) + " us";
+  };
+  log_info("Connected to [" + server_ip + "]:" + to_string(server_port));
+  log_debug("Connecting took " + us(steady_clock::now() - start) +
+            " (resolving " + us(resolved - start) + ", " + to_string(next) +
+            " of " + to_string(order.size()) + " addresses tried).");
   freeaddrinfo(res);
   return socket_fd;
 }
 
+int Client::connect_to_unix() {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (unix_path.size() >= sizeof(addr.sun_path)) {
+    print_error("socket path is too long: " + unix_path);
+    return -1;
+  }
+  unix_path.copy(addr.sun_path, unix_path.size());
+
+  socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket_fd < 0) {
+    print_error("cannot create socket: " + string(strerror(errno)));
+    return -1;
+  }
+  if (connect(socket_fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    print_error("cannot connect to server: " + string(strerror(errno)));
+    close(socket_fd);
+    socket_fd = -1;
+    return -1;
+  }
+
+  fds[1].fd = socket_fd;
+  fds[1].events = POLLIN | POLLOUT;
+  fds[1].revents = 0;
+  server_ip = unix_path;
+
+  log_info("Connected to " + unix_path);
+  return socket_fd;
+}
+
 int Client::send_hello() {
-  messages_to_send.push("HELLO " + player_id + "\r\n");
+  string hello = "HELLO " + player_id;
+  if (compact_scoring) {
+    hello += " COMPACT";
+  }
+  if (room >= 0) {
+    hello += " ROOM=" + to_string(room);
+  }
+  messages_to_send.push(hello + "\r\n");
   return 0;
 }
 
@@ -173,16 +380,33 @@ int Client::read_message() {
                 string(strerror(errno)));
     return -1;
   } else if (read_len == 0) {
-    cout << "Server closed the connection." << endl;
+    log_info("Server closed the connection.");
+    server_closed = true;
     return 1;
   }
   size_t old_len = received_buffer.size();
   received_buffer += string(buffer.data(), (size_t)read_len);
 
+  return handle_received(old_len ? old_len - 1 : 0);
+}
+
+int Client::start_next_game() {
+  got_coeff = false;
+  got_response = false;
+  sent_puts.clear();  // Their replies were dropped with the game
+  sent_bad_puts.clear();
+  phase = Phase::WAIT_COEFF;
+  put_scheduled = false;
+  prepared.reset();
+  in_flight = 0;
+  // The next COEFF may have arrived together with the last SCORING.
+  return handle_received(0);
+}
+
+int Client::handle_received(size_t scan_from) {
   vector<string> messages;
   size_t erase_pref = 0;
-  for (size_t i = old_len ? old_len - 1 : 0; i < received_buffer.size() - 1;
-       ++i) {
+  for (size_t i = scan_from; i + 1 < received_buffer.size(); ++i) {
     if (received_buffer[i] == '\r' and received_buffer[i + 1] == '\n') {
       // Found end of a message.
       messages.push_back(
@@ -192,18 +416,37 @@ int Client::read_message() {
   }
   received_buffer.erase(0, erase_pref);
 
+  auto game_ended = [&](size_t i) {
+    // Messages after the scoring belong to the next game (lobby mode).
+    string rest;
+    for (size_t j = i + 1; j < messages.size(); ++j) {
+      rest += messages[j];
+    }
+    received_buffer = rest + received_buffer;
+    return 1;
+  };
+
   for (size_t i = 0; i < messages.size(); ++i) {
     string &msg = messages[i];
     if (is_valid_scoring(msg)) {
-      cout << "Game end, scoring: " << msg.substr(8, msg.size() - 10) << "."
-           << endl;
-      return 1;  // Game ended
+      log_info("Game end, scoring: " + msg.substr(8, msg.size() - 10) + ".");
+      return game_ended(i);
+    } else if (is_valid_compact_scoring(msg)) {
+      // SCORING_TOP <rank> <error> <top players>
+      size_t error_start = msg.find(' ', 12) + 1;
+      size_t top_start = min(msg.find(' ', error_start), msg.size() - 2);
+      log_info("Game end, rank " + msg.substr(12, error_start - 13) +
+               " with error " +
+               msg.substr(error_start, top_start - error_start) +
+               ", top scoring:" +
+               msg.substr(top_start, msg.size() - 2 - top_start) + ".");
+      return game_ended(i);
     } else if (!got_coeff) {
       if (valid_coeff(msg)) {
         got_coeff = true;
         got_response = true;
-        cout << "Received coefficients: " << msg.substr(6, msg.size() - 8)
-             << "." << endl;
+        log_info("Received coefficients: " + msg.substr(6, msg.size() - 8) +
+                 ".");
         coefficients = parse_coefficients(msg);
         n = (int32_t)coefficients.size() - 1;
       } else {
@@ -214,13 +457,16 @@ int Client::read_message() {
     } else {
       if (valid_bad_put(msg)) {
         // Niesprecyzowano w tresci czy wypisywac tu cokolwiek
+        note_reply(msg);
       } else if (valid_penalty(msg)) {
         // Niesprecyzowano w tresci czy wypisywac tu cokolwiek
+        note_reply(msg);
       } else if (valid_state(msg)) {
         got_response = true;
+        note_reply(msg);
         k = (int32_t)count(msg.begin(), msg.end(), ' ') - 1;
-        cout << "Received state " << msg.substr(6, msg.size() - 8) << "."
-             << endl;
+        log_values(LogCategory::STATE, "Received state ",
+                   string_view(msg).substr(6, msg.size() - 8), ".");
       } else {
         print_error("bad message from [" + server_ip + "]:" +
                     to_string(server_port) + ", " + player_id + ": " + msg);
@@ -246,203 +492,227 @@ int Client::read_from_stdin() {
     print_error("invalid input line " + line);
     return 0;
   }
-  cout << "Putting " << value << " in " << point_int << "." << endl;
+  log_info("Putting " + value + " in " + to_string(point_int) + ".",
+           LogCategory::PUT);
   messages_to_send.push("PUT " + point + " " + value + "\r\n");
   return 0;
 }
 
-int Client::auto_play() {
-  // here I dont need stdin.
-  // first I need to get the coefficients
-  while (!got_coeff) {
-    fds[1].revents = 0;
-    fds[1].events = POLLIN;
-    if (!messages_to_send.empty()) {
-      fds[1].events |= POLLOUT;  // I have to send Hello
-    }
-    int poll_status = poll(fds + 1, 1, -1);
-    if (poll_status < 0) {
-      print_error("Poll error occurred: " + string(strerror(errno)));
-      return -1;
-    }
-    if (fds[1].revents & POLLIN) {
-      int res = read_message();
-      if (res < 0) {
-        return -1;  // Error reading message
-      } else if (res) {
-        return 0;  // Game ended
-      }
-    }
-    if (fds[1].revents & POLLOUT) {
-      if (!messages_to_send.empty()) {
-        messages_to_send.send_message(fds[1].fd);
-      }
+seconds Client::state_delay() const {
+  auto small = count_if(player_id.begin(), player_id.end(),
+                        [](char c) { return c >= 'a' and c <= 'z'; });
+  return seconds((int64_t)STATE_DELAY_S_PER_SMALL_LETTER * small);
+}
+
+void Client::put(int32_t point, double value) {
+  log_info("Putting " + format_double(value) + " in " + to_string(point) +
+               ".",
+           LogCategory::PUT);
+  messages_to_send.push("PUT " + to_string(point) + " " +
+                        to_proper_rational(value) + "\r\n");
+}
+
+void Client::send_pending() {
+  if (!messages_to_send.send_message(socket_fd)) {
+    return;
+  }
+  const string &sent = messages_to_send.sent_message;
+  if (!sent.starts_with("PUT ")) {
+    return;
+  }
+  auto now = steady_clock::now();
+  if (phase == Phase::WAIT_K or phase == Phase::PLAYING) {
+    strategy->on_sent(now);
+  }
+  if (rtt != NULL) {
+    if (rtt->first_put.load(memory_order_relaxed) ==
+        steady_clock::time_point{}) {
+      rtt->first_put.store(now, memory_order_relaxed);
     }
+    // "PUT <point> <value>\r\n", PENALTY and BAD_PUT repeat the arguments.
+    string args = sent.substr(4, sent.size() - 6);
+    (is_bad_put(args) ? sent_bad_puts : sent_puts).emplace_back(args, now);
   }
+}
 
-  // now I have the coefficients
-  // I send PUT 0 0 to get to know k
-  cout << "Putting 0 in 0." << endl;
-  messages_to_send.push("PUT 0 0\r\n");
+bool Client::is_bad_put(const string &args) const {
+  size_t space = args.find(' ');
+  if (space == string::npos) {
+    return true;
+  }
+  // Before the first STATE only the first PUT, at point 0, is sent.
+  int64_t point = get_int(args.substr(0, space), k < 0 ? INT32_MAX : k);
+  double value = get_double(args.substr(space + 1));
+  return point < 0 or value < -MAX_PUT_VALUE or value > MAX_PUT_VALUE;
+}
 
-  got_response = false;
-  while (!got_response) {
-    fds[1].revents = 0;
-    fds[1].events = POLLIN;
-    if (!messages_to_send.empty()) {
-      fds[1].events |= POLLOUT;
+void Client::note_reply(const string &msg) {
+  if (in_flight > 0) {
+    --in_flight;
+  }
+  if (phase == Phase::WAIT_K or phase == Phase::PLAYING) {
+    strategy->on_reply(msg);
+  }
+  if (rtt == NULL) {
+    return;
+  }
+  // STATE answers the oldest proper PUT. PENALTY and BAD_PUT come sooner or
+  // later than STATEs of earlier PUTs, so they answer the oldest PUT with
+  // their arguments, looked up first among the PUTs that get their kind of
+  // reply. Equal PUTs may swap their times, which I don't mind.
+  auto *sent = &sent_puts;
+  auto put = sent_puts.begin();
+  uint64_t delay_s = 0;
+  if (msg.starts_with("STATE ")) {
+    if (sent_puts.empty()) {
+      return;
     }
-    int poll_status = poll(fds + 1, 1, -1);
-    if (poll_status < 0) {
-      print_error("Poll error occurred: " + string(strerror(errno)));
-      return -1;
+    delay_s = (uint64_t)state_delay().count();
+  } else {
+    size_t args_start = msg.find(' ') + 1;
+    string_view args(msg.data() + args_start, msg.size() - 2 - args_start);
+    bool penalty = msg.starts_with("PENALTY ");
+    auto find = [&](deque<pair<string, steady_clock::time_point>> &in) {
+      sent = &in;
+      put = find_if(in.begin(), in.end(),
+                    [&](const auto &p) { return p.first == args; });
+      return put != in.end();
+    };
+    if (!find(penalty ? sent_puts : sent_bad_puts) and
+        !find(penalty ? sent_bad_puts : sent_puts)) {
+      return;
     }
-    if (fds[1].revents & POLLIN) {
-      int res = read_message();
-      if (res < 0) {
-        return -1;  // Error reading message
-      } else if (res) {
-        return 0;  // Game ended
+    delay_s = penalty ? PENALTY_DELAY_S : BAD_PUT_DELAY_S;
+  }
+
+  auto now = steady_clock::now();
+  int64_t us = duration_cast<microseconds>(now - put->second).count();
+  int64_t extra = us - (int64_t)delay_s * 1000000;
+  rtt->rtt_us.record((uint64_t)us);
+  rtt->extra_us.record((uint64_t)max<int64_t>(extra, 0));
+  rtt->replies.add();
+  rtt->last_reply.store(now, memory_order_relaxed);
+  sent->erase(put);
+}
+
+int Client::poll_fds(pollfd *first, nfds_t count, int timeout_ms) {
+  while (true) {
+    exit_if_stop_requested();
+    if (rtt_report_requested) {
+      rtt_report_requested = 0;
+      if (rtt != NULL) {
+        log_info(rtt->summary());
       }
     }
-    if (fds[1].revents & POLLOUT) {
-      if (!messages_to_send.empty()) {
-        messages_to_send.send_message(fds[1].fd);
-      }
+    int res = poll(first, count, timeout_ms);
+    if (res >= 0 or errno != EINTR) {
+      return res;
     }
   }
+}
 
-  // now that i know k I calculate values of the polynomial
-  // at all point 0, 1, ..., k and sort them
-  using el = pair<pair<double, double>, int32_t>;
-  priority_queue<el, vector<el>, less<el>> val_que;
+int Client::on_readable() { return advance(read_message()); }
 
-  for (size_t i = 0; i <= (size_t)k; ++i) {
-    double power = 1.0;
-    double value = 0.0;
-    for (size_t j = 0; j <= (size_t)n; ++j) {
-      value += coefficients[j] * power;
-      power *= (double)i;
-    }
-    val_que.push({{fabs(value), value}, (int32_t)i});
+void Client::on_writable() {
+  if (!messages_to_send.empty()) {
+    send_pending();
   }
+}
 
-  // now I send PUT messages for all points form largest to smallest
-  while (!val_que.empty()) {
-    auto values = val_que.top();
-    val_que.pop();
-    if (values.first.first >= 5) {
-      double val = 0;
-      if (values.first.second < 0) {
-        val = -5;
-      } else {
-        val = 5;
-      }
-      cout << "Putting " << val << " in " << values.second << "." << endl;
-      string msg = "PUT " + to_string(values.second) + " " +
-                   to_proper_rational(val) + "\r\n";
-      messages_to_send.push(msg);
-
-      values.first.first -= fabs(val);
-      values.first.second -= val;
-      val_que.push(values);
-    } else {
-      double val = values.first.second;
-      cout << "Putting " << val << " in " << values.second << "." << endl;
-      string msg = "PUT " + to_string(values.second) + " " +
-                   to_proper_rational(val) + "\r\n";
-      messages_to_send.push(msg);
-    }
-
-    while (!messages_to_send.empty()) {
-      fds[1].revents = 0;
-      fds[1].events = POLLIN | POLLOUT;
-      int poll_status = poll(fds + 1, 1, -1);
-      if (poll_status < 0) {
-        print_error("Poll error occurred: " + string(strerror(errno)));
-        return -1;
-      }
-      if (fds[1].revents & POLLIN) {
-        int res = read_message();
-        if (res < 0) {
-          return -1;  // Error reading message
-        } else if (res) {
-          return 0;  // Game ended
-        }
-      }
-      if (fds[1].revents & POLLOUT) {
-        messages_to_send.send_message(fds[1].fd);
-      }
-    }
-    got_response = false;
+void Client::on_timer(steady_clock::time_point now) {
+  if (put_scheduled and next_put <= now) {
+    put_scheduled = false;
+    put_next();
+    advance(0);
+  }
+}
 
-    while (!got_response) {
-      fds[1].revents = 0;
-      fds[1].events = POLLIN;
-      int poll_status = poll(fds + 1, 1, -1);
-      if (poll_status < 0) {
-        print_error("Poll error occurred: " + string(strerror(errno)));
-        return -1;
-      }
-      if (fds[1].revents & POLLIN) {
-        int res = read_message();
-        if (res < 0) {
-          return -1;  // Error reading message
-        } else if (res) {
-          return 0;  // Game ended
-        }
-      }
+int Client::advance(int handle_res) {
+  if (handle_res != 0) {
+    if (phase != Phase::DONE) {
+      strategy->finish();
     }
+    phase = Phase::DONE;
+    return handle_res;
   }
 
-  // now I just send 0s until the game ends
-  while (true) {
-    if (got_response) {
-      // I truy to send PUT 0 0\r\n
-      cout << "Putting 0 in 0." << endl;
+  // A PUT at point 0 to get to know k, then the strategy.
+  if (phase == Phase::WAIT_COEFF and got_coeff) {
+    double value = strategy->first_value(coefficients);
+    if (value == 0) {
+      log_info("Putting 0 in 0.", LogCategory::PUT);
       messages_to_send.push("PUT 0 0\r\n");
-      while (!messages_to_send.empty()) {
-        fds[1].revents = 0;
-        fds[1].events = POLLIN | POLLOUT;
-        int poll_status = poll(fds + 1, 1, -1);
-        if (poll_status < 0) {
-          print_error("Poll error occurred: " + string(strerror(errno)));
-          return -1;
-        }
-        if (fds[1].revents & POLLIN) {
-          int res = read_message();
-          if (res < 0) {
-            return -1;  // Error reading message
-          } else if (res) {
-            return 0;  // Game ended
-          }
-        }
-        if (fds[1].revents & POLLOUT) {
-          messages_to_send.send_message(fds[1].fd);
-        }
-      }
-      got_response = false;
     } else {
-      fds[1].revents = 0;
-      fds[1].events = POLLIN;
-      int poll_status = poll(fds + 1, 1, -1);
-      if (poll_status < 0) {
-        print_error("Poll error occurred: " + string(strerror(errno)));
-        return -1;
-      }
-      if (fds[1].revents & POLLIN) {
-        int res = read_message();
-        if (res)
-          return -1;  // Error reading message
-        else if (res) {
-          return 0;  // Game ended
-        }
-      }
+      put(0, value);
+    }
+    ++puts;
+    ++in_flight;
+    got_response = false;
+    phase = Phase::WAIT_K;
+  }
+  if (phase == Phase::WAIT_K and got_response) {
+    strategy->start(coefficients, k);
+    prepared = strategy->next();
+    phase = Phase::PLAYING;
+  }
+  while (phase == Phase::PLAYING and !put_scheduled and
+         strategy->may_send(in_flight)) {
+    if (think_time.count() > 0) {
+      next_put = steady_clock::now() + think_time;
+      put_scheduled = true;
+    } else {
+      put_next();
     }
   }
   return 0;
 }
 
+void Client::put_next() {
+  auto [point, value] = *prepared;
+  put(point, value);
+  ++puts;
+  ++in_flight;
+  // The strategy works on the next PUT while this one is on its way.
+  prepared = strategy->next();
+}
+
+int Client::auto_play() {
+  int flags = fcntl(socket_fd, F_GETFL);
+  if (flags < 0 or fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    print_error("Cannot set socket to non-blocking: " +
+                string(strerror(errno)));
+    return -1;
+  }
+  // The COEFF may have come together with the last SCORING (lobby mode).
+  int res = advance(0);
+  while (res == 0) {
+    fds[1].revents = 0;
+    fds[1].events = POLLIN;
+    if (!messages_to_send.empty()) {
+      fds[1].events |= POLLOUT;
+    }
+    int timeout_ms = -1;
+    if (put_scheduled) {
+      auto wait = next_put - steady_clock::now();
+      timeout_ms = (int)max<int64_t>(0, ceil<milliseconds>(wait).count());
+    }
+    if (poll_fds(fds + 1, 1, timeout_ms) < 0) {
+      print_error("Poll error occurred: " + string(strerror(errno)));
+      return -1;
+    }
+    if (fds[1].revents & (POLLIN | POLLERR | POLLHUP)) {
+      res = on_readable();
+    }
+    if (res == 0 and fds[1].revents & POLLOUT) {
+      on_writable();
+    }
+    if (res == 0) {
+      on_timer(steady_clock::now());
+    }
+  }
+  return res < 0 ? -1 : 0;
+}
+
 int Client::interactive_play() {
   // First getting the coefficients
   while (!got_coeff) {
@@ -451,7 +721,7 @@ int Client::interactive_play() {
     if (!messages_to_send.empty()) {
       fds[1].events |= POLLOUT;  // I have to send Hello
     }
-    int poll_status = poll(fds + 1, 1, -1);
+    int poll_status = poll_fds(fds + 1, 1);
     if (poll_status < 0) {
       print_error("Poll error occurred: " + string(strerror(errno)));
       return -1;
@@ -466,7 +736,7 @@ int Client::interactive_play() {
     }
     if (fds[1].revents & POLLOUT) {
       if (!messages_to_send.empty()) {
-        messages_to_send.send_message(fds[1].fd);
+        send_pending();
       }
     }
   }
@@ -486,7 +756,7 @@ int Client::interactive_play() {
       fds[1].events = POLLIN | POLLOUT;
     }
 
-    int poll_status = poll(fds, 2, -1);
+    int poll_status = poll_fds(fds, 2);
 
     if (poll_status < 0) {
       print_error("Poll error occurred: " + string(strerror(errno)));
@@ -504,7 +774,7 @@ int Client::interactive_play() {
       }
     }
     if (fds[1].revents & POLLOUT and !messages_to_send.empty()) {
-      messages_to_send.send_message(fds[1].fd);
+      send_pending();
     }
     if (fds[0].revents & POLLIN) {
       if (read_from_stdin() < 0) {
@@ -6,14 +6,35 @@
 #include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <deque>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <optional>
 #include <queue>
 #include <string>
 
+#include "../common/metrics.hpp"
+#include "strategy.hpp"
+
 using namespace std;
+using namespace std::chrono;
+
+// Set by SIGUSR1 (approx-client -m), the RTT summary is logged at the next
+// poll.
+extern volatile sig_atomic_t rtt_report_requested;
+// Set to the signal number by SIGINT and SIGTERM, the client writes out the end
+// of its log and exits at the next poll.
+extern volatile sig_atomic_t stop_requested;
+
+// Exits with 128 + the signal number if a stop was requested.
+void exit_if_stop_requested();
 
 bool check_mandatory_option(const map<char, char *> &args, char option);
 
@@ -26,19 +47,43 @@ struct ClientMessageQueue {
   queue<string> messages;
   string current_message;
   size_t current_pos = 0;
+  string sent_message;  // The last message written completely
 
   void push(const string &msg);
+  // Also false while a message is partially sent.
   bool empty() const;
-  void send_message(int socket_fd);
+  // returns true if the message was written completely
+  bool send_message(int socket_fd);
+};
+
+// Round trips of PUTs, from the write of their last byte to their STATE,
+// PENALTY or BAD_PUT. extra_us leaves out the delay the server adds on
+// purpose, what remains is network and server queueing. Like the metrics,
+// one thread records with relaxed atomics and any thread may read.
+struct RttStats {
+  Histogram rtt_us;
+  Histogram extra_us;
+  Counter replies;
+  atomic<steady_clock::time_point> first_put{};  // Of the measurement
+  atomic<steady_clock::time_point> last_reply{};
+
+  // Adds the values of other. If its thread is still recording, the sum may
+  // mix values from moments apart (SIGUSR1 reports of approx-client -c).
+  RttStats &operator+=(const RttStats &other);
+  // Percentiles and replies per second in one line.
+  string summary() const;
 };
 
 struct Client {
   string player_id;
   string server_address;
   uint16_t server_port;
+  string unix_path;  // Connects to this AF_UNIX socket instead if not empty
   string server_ip;
   int socket_fd = -1;
-  int32_t k, n;
+  int32_t k = -1, n;  // k is -1 until the first STATE
+  bool compact_scoring = false;  // Ask the server for SCORING_TOP
+  int64_t room = -1;             // Requested room, -1 lets the server choose
 
   ClientMessageQueue messages_to_send;
   string received_buffer;
@@ -47,10 +92,28 @@ struct Client {
 
   bool got_coeff = false;
   bool got_response = false;
+  bool server_closed = false;
   vector<double> coefficients;
 
+  // Auto play, driven by on_readable, on_writable and on_timer.
+  enum class Phase { WAIT_COEFF, WAIT_K, PLAYING, DONE };
+  Phase phase = Phase::WAIT_COEFF;
+  unique_ptr<Strategy> strategy = make_unique<GreedyStrategy>();
+  milliseconds think_time{0};  // Pause between a reply and the next PUT
+  steady_clock::time_point next_put;
+  bool put_scheduled = false;  // next_put is set and the PUT not queued yet
+  optional<pair<int32_t, double>> prepared;  // Next PUT of the strategy
+  size_t in_flight = 0;                      // PUTs queued and not answered
+  uint64_t puts = 0;
+
   pollfd fds[2];  // fds[0] is for stdin, fds[1] is for the server socket
 
+  RttStats *rtt = NULL;  // Round trips are measured if not NULL
+  // PUTs written and not answered yet: arguments and time. PUTs that get
+  // BAD_PUT, a second later than the STATEs of the PUTs after them, wait
+  // apart, so a STATE is matched with a proper PUT.
+  deque<pair<string, steady_clock::time_point>> sent_puts, sent_bad_puts;
+
   Client(string _player_id, string _server_address, uint16_t _server_port)
       : player_id(_player_id),
         server_address(_server_address),
@@ -62,12 +125,47 @@ struct Client {
   // returns -1 on error
   int connect_to_server(bool force_ipv4, bool force_ipv6);
   // returns -1 on error
+  int connect_to_unix();
+  // returns -1 on error
   int send_hello();
 
   // returns -1 on error, 1 if the game ended, 0 otherwise
   int read_message();
+  // Parses complete messages from received_buffer, same result as
+  // read_message. Messages after a scoring stay in the buffer.
+  int handle_received(size_t scan_from);
+  // Resets the per-game state for the next game on the same connection.
+  // returns -1 on error, 1 if the game already ended, 0 otherwise
+  int start_next_game();
   int read_from_stdin();
+  // Writes the next queued message, noting when a PUT is sent.
+  void send_pending();
+  // Whether the server answers PUT <args> with BAD_PUT.
+  bool is_bad_put(const string &args) const;
+  // Counts the reply (STATE, PENALTY or BAD_PUT), tells the strategy and
+  // matches it with a sent PUT.
+  void note_reply(const string &msg);
+  // poll, which retries when a signal interrupts it and logs the RTT summary
+  // if SIGUSR1 asked for it.
+  int poll_fds(pollfd *first, nfds_t count, int timeout_ms = -1);
+  // Delay of every STATE, for the small letters of the id.
+  seconds state_delay() const;
+  // Logs and queues PUT point value.
+  void put(int32_t point, double value);
+
+  // Handlers of the auto play event loop.
+  // returns -1 on error, 1 if the game ended, 0 otherwise
+  int on_readable();
+  void on_writable();
+  // Queues the scheduled PUT if it is time for it.
+  void on_timer(steady_clock::time_point now);
+  // Moves through the phases after messages were handled.
+  // returns -1 on error, 1 if the game ended, 0 otherwise
+  int advance(int handle_res);
+  // Queues the prepared PUT and has the strategy prepare the next one.
+  void put_next();
 
+  // One poll loop over the handlers until the game ends.
   // Returns -1 on error
   int auto_play();
   // Returns -1 on error
@@ -0,0 +1,162 @@
+#include "alloc.hpp"
+
+#ifdef APPROX_ALLOC_STATS
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+
+namespace {
+constexpr size_t N_TAGS = (size_t)AllocTag::N_TAGS;
+constexpr size_t MAX_THREADS = 256;  // Later threads share the last slot
+// Every block starts with its size and tag, so delete knows whom to credit.
+// 16 bytes keep the alignment of malloc.
+constexpr size_t HEADER = 16;
+
+const char* const TAG_NAMES[N_TAGS] = {"other",   "framing", "parsing",
+                                       "state",   "queue",   "scoring",
+                                       "logging"};
+
+// Written by one thread (except the shared last slot), read by dumps.
+struct ThreadCounters {
+  atomic<uint64_t> allocs[N_TAGS];
+  atomic<uint64_t> bytes[N_TAGS];
+};
+
+// Static storage only, operator new can't allocate to count itself.
+ThreadCounters thread_counters[MAX_THREADS];
+atomic<size_t> n_threads{0};
+atomic<int64_t> live_bytes[N_TAGS];
+atomic<int64_t> peak_bytes[N_TAGS];
+
+thread_local AllocTag current_tag = AllocTag::OTHER;
+thread_local ThreadCounters* counters = nullptr;
+
+void* allocate(size_t size) {
+  char* block = (char*)malloc(size + HEADER);
+  if (block == nullptr) {
+    return nullptr;
+  }
+  size_t tag = (size_t)current_tag;
+  ((uint64_t*)block)[0] = size;
+  ((uint64_t*)block)[1] = tag;
+
+  if (counters == nullptr) {
+    size_t slot = n_threads.fetch_add(1, memory_order_relaxed);
+    counters = &thread_counters[min(slot, MAX_THREADS - 1)];
+  }
+  counters->allocs[tag].fetch_add(1, memory_order_relaxed);
+  counters->bytes[tag].fetch_add(size, memory_order_relaxed);
+  int64_t live =
+      live_bytes[tag].fetch_add((int64_t)size, memory_order_relaxed) +
+      (int64_t)size;
+  int64_t peak = peak_bytes[tag].load(memory_order_relaxed);
+  while (live > peak and !peak_bytes[tag].compare_exchange_weak(
+                             peak, live, memory_order_relaxed)) {
+  }
+  return block + HEADER;
+}
+
+void deallocate(void* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  char* block = (char*)ptr - HEADER;
+  uint64_t size = ((uint64_t*)block)[0];
+  uint64_t tag = ((uint64_t*)block)[1];
+  live_bytes[tag].fetch_sub((int64_t)size, memory_order_relaxed);
+  free(block);
+}
+}  // namespace
+
+void* operator new(size_t size) {
+  void* ptr = allocate(size);
+  if (ptr == nullptr) {
+    throw bad_alloc();
+  }
+  return ptr;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const nothrow_t&) noexcept {
+  return allocate(size);
+}
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+  return allocate(size);
+}
+void operator delete(void* ptr) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, const nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void* ptr, const nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+
+AllocScope::AllocScope(AllocTag tag) : previous(current_tag) {
+  current_tag = tag;
+}
+AllocScope::~AllocScope() { current_tag = previous; }
+
+string alloc_stats_dump(uint64_t puts) {
+  uint64_t allocs[N_TAGS] = {}, bytes[N_TAGS] = {};
+  size_t threads = min(n_threads.load(memory_order_relaxed), MAX_THREADS);
+  for (size_t t = 0; t < threads; ++t) {
+    for (size_t tag = 0; tag < N_TAGS; ++tag) {
+      const ThreadCounters& c = thread_counters[t];
+      allocs[tag] += c.allocs[tag].load(memory_order_relaxed);
+      bytes[tag] += c.bytes[tag].load(memory_order_relaxed);
+    }
+  }
+
+  struct Series {
+    const char* name;
+    const char* type;
+    const char* help;
+  };
+  const Series series[] = {
+      {"approx_alloc_total", "counter", "Allocations by tag."},
+      {"approx_alloc_bytes_total", "counter", "Allocated bytes by tag."},
+      {"approx_alloc_live_bytes", "gauge", "Bytes not freed yet by tag."},
+      {"approx_alloc_peak_bytes", "gauge", "Most live bytes by tag."},
+      {"approx_allocs_per_put", "gauge", "Allocations per PUT by tag."}};
+  string res;
+  for (size_t s = 0; s < size(series); ++s) {
+    if (s == 4 and puts == 0) {
+      break;
+    }
+    res += string("# HELP ") + series[s].name + " " + series[s].help + "\n";
+    res += string("# TYPE ") + series[s].name + " " + series[s].type + "\n";
+    for (size_t tag = 0; tag < N_TAGS; ++tag) {
+      string value;
+      switch (s) {
+        case 0:
+          value = to_string(allocs[tag]);
+          break;
+        case 1:
+          value = to_string(bytes[tag]);
+          break;
+        case 2:
+          value = to_string(live_bytes[tag].load(memory_order_relaxed));
+          break;
+        case 3:
+          value = to_string(peak_bytes[tag].load(memory_order_relaxed));
+          break;
+        default:
+          value = to_string((double)allocs[tag] / (double)puts);
+      }
+      res += string(series[s].name) + "{tag=\"" + TAG_NAMES[tag] + "\"} " +
+             value + "\n";
+    }
+  }
+  return res;
+}
+
+#else
+
+string alloc_stats_dump(uint64_t) { return ""; }
+
+#endif
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Allocation accounting, compiled in only with -DAPPROX_ALLOC_STATS
+// (make ALLOC_STATS=1). Then the global operator new/delete count every
+// allocation for the tag of the innermost ALLOC_SCOPE of the thread, and the
+// bytes for the tag until they are freed, from any thread. Otherwise
+// ALLOC_SCOPE expands to nothing.
+
+enum class AllocTag {
+  OTHER,
+  FRAMING,  // Splitting the input into messages
+  PARSING,  // HELLO and PUT arguments
+  STATE,    // STATE messages
+  QUEUE,    // Messages waiting to be sent
+  SCORING,  // SCORING and SCORING_TOP
+  LOGGING,  // Log lines and the writer thread
+  N_TAGS
+};
+
+#ifdef APPROX_ALLOC_STATS
+constexpr bool ALLOC_STATS_ENABLED = true;
+
+// Sets the tag of the thread until the end of the scope.
+class AllocScope {
+  AllocTag previous;
+
+ public:
+  explicit AllocScope(AllocTag tag);
+  ~AllocScope();
+  AllocScope(const AllocScope&) = delete;
+  AllocScope& operator=(const AllocScope&) = delete;
+};
+
+#define ALLOC_CONCAT_(a, b) a##b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_(a, b)
+#define ALLOC_SCOPE(tag) AllocScope ALLOC_CONCAT(alloc_scope_, __LINE__)(tag)
+#else
+constexpr bool ALLOC_STATS_ENABLED = false;
+#define ALLOC_SCOPE(tag)
+#endif
+
+// Prometheus text with allocations, bytes, live and peak bytes of every tag,
+// summed over all threads, and allocations per PUT if puts > 0. Empty if the
+// accounting is not compiled in.
+string alloc_stats_dump(uint64_t puts);
@@ -0,0 +1,344 @@
+#include "log.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "alloc.hpp"
+
+namespace {
+
+enum class Policy { FULL, OFF, DIGEST, TRUNCATE, SAMPLE };
+
+struct CategoryConfig {
+  Policy policy = Policy::FULL;
+  size_t param = 0;  // values kept by TRUNCATE, period of SAMPLE
+  atomic<uint64_t> counter{0};
+};
+
+struct LogEntry {
+  int fd = STDOUT_FILENO;
+  string text;  // Including the newline
+};
+
+// Bounded multi-producer queue (Vyukov), the writer thread is the only
+// consumer.
+class LogQueue {
+  struct Cell {
+    atomic<size_t> seq;
+    LogEntry entry;
+  };
+  vector<Cell> cells;
+  size_t mask;
+  atomic<size_t> enqueue_pos{0};
+  size_t dequeue_pos = 0;
+
+ public:
+  explicit LogQueue(size_t capacity) : cells(capacity), mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; ++i) {
+      cells[i].seq.store(i, memory_order_relaxed);
+    }
+  }
+
+  // returns false iff the queue is full
+  bool push(LogEntry& entry) {
+    size_t pos = enqueue_pos.load(memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t seq = cell->seq.load(memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(memory_order_relaxed);
+      }
+    }
+    cell->entry = std::move(entry);
+    cell->seq.store(pos + 1, memory_order_release);
+    return true;
+  }
+
+  // returns false iff the queue is empty
+  bool pop(LogEntry& entry) {
+    Cell& cell = cells[dequeue_pos & mask];
+    size_t seq = cell.seq.load(memory_order_acquire);
+    if (seq != dequeue_pos + 1) {
+      return false;
+    }
+    entry = std::move(cell.entry);
+    // The move leaves the old buffer of entry in the cell, the cells would
+    // keep the biggest lines they ever had.
+    string().swap(cell.entry.text);
+    cell.seq.store(dequeue_pos + mask + 1, memory_order_release);
+    ++dequeue_pos;
+    return true;
+  }
+};
+
+constexpr size_t QUEUE_CAPACITY = 1 << 14;
+constexpr size_t BATCH_BYTES = 1 << 16;
+
+class Logger {
+  LogQueue queue{QUEUE_CAPACITY};
+  atomic<uint32_t> signal{0};   // Bumped on every push, the writer waits on it
+  atomic<uint64_t> pushed{0};
+  atomic<uint64_t> written{0};  // Entries already written
+  atomic<bool> stop{false};
+  thread writer;
+
+  string batch;
+  int batch_fd = STDOUT_FILENO;
+
+  void write_batch() {
+    size_t pos = 0;
+    while (pos < batch.size()) {
+      ssize_t res = ::write(batch_fd, batch.data() + pos, batch.size() - pos);
+      if (res < 0) {
+        if (errno == EINTR or errno == EAGAIN) {
+          continue;
+        }
+        break;  // Nowhere to report it.
+      }
+      pos += (size_t)res;
+    }
+    batch.clear();
+  }
+
+  void run() {
+    ALLOC_SCOPE(AllocTag::LOGGING);
+    LogEntry entry;
+    while (true) {
+      uint32_t seen = signal.load(memory_order_acquire);
+      uint64_t n_written = 0;
+      while (queue.pop(entry)) {
+        if (entry.fd != batch_fd or batch.size() >= BATCH_BYTES) {
+          write_batch();  // Keeps the order of stdout and stderr lines.
+          batch_fd = entry.fd;
+        }
+        batch += entry.text;
+        ++n_written;
+      }
+      write_batch();
+      written.fetch_add(n_written, memory_order_release);
+      written.notify_all();
+      if (n_written == 0) {
+        if (stop.load(memory_order_acquire)) {
+          return;
+        }
+        signal.wait(seen, memory_order_acquire);
+      }
+    }
+  }
+
+ public:
+  LogLevel level = LogLevel::INFO;
+  CategoryConfig categories[(size_t)LogCategory::N_CATEGORIES];
+
+  Logger() { writer = thread([this]() { run(); }); }
+  ~Logger() {
+    stop.store(true, memory_order_release);
+    signal.fetch_add(1, memory_order_release);
+    signal.notify_one();
+    writer.join();
+  }
+
+  void push(int fd, string text) {
+    LogEntry entry{fd, std::move(text)};
+    while (!queue.push(entry)) {
+      // Full queue, the writer is behind. I wait instead of dropping lines.
+      signal.fetch_add(1, memory_order_release);
+      signal.notify_one();
+      this_thread::yield();
+    }
+    pushed.fetch_add(1, memory_order_relaxed);
+    signal.fetch_add(1, memory_order_release);
+    signal.notify_one();
+  }
+
+  void flush() {
+    uint64_t target = pushed.load(memory_order_relaxed);
+    uint64_t done = written.load(memory_order_acquire);
+    while (done < target) {
+      written.wait(done, memory_order_acquire);
+      done = written.load(memory_order_acquire);
+    }
+  }
+};
+
+Logger& logger() {
+  static Logger instance;
+  return instance;
+}
+
+// returns false iff the line of the category is not logged (off or sampled
+// out)
+bool take_line(LogCategory category) {
+  CategoryConfig& config = logger().categories[(size_t)category];
+  if (config.policy == Policy::OFF) {
+    return false;
+  }
+  if (config.policy == Policy::SAMPLE) {
+    return config.counter.fetch_add(1, memory_order_relaxed) % config.param ==
+           0;
+  }
+  return true;
+}
+
+// FNV-1a, enough to tell states apart in the log.
+uint64_t digest(string_view text) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : text) {
+    hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+  }
+  return hash;
+}
+
+}  // namespace
+
+int log_configure(const string& spec) {
+  Logger& log = logger();
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == string::npos) {
+      end = spec.size();
+    }
+    string item = spec.substr(start, end - start);
+    start = end + 1;
+
+    size_t eq = item.find('=');
+    if (eq == string::npos) {
+      return -1;
+    }
+    string key = item.substr(0, eq);
+    string value = item.substr(eq + 1);
+
+    if (key == "level") {
+      if (value == "error") {
+        log.level = LogLevel::ERROR;
+      } else if (value == "info") {
+        log.level = LogLevel::INFO;
+      } else if (value == "debug") {
+        log.level = LogLevel::DEBUG;
+      } else {
+        return -1;
+      }
+      continue;
+    }
+
+    LogCategory category;
+    if (key == "general") {
+      category = LogCategory::GENERAL;
+    } else if (key == "state") {
+      category = LogCategory::STATE;
+    } else if (key == "put") {
+      category = LogCategory::PUT;
+    } else {
+      return -1;
+    }
+    CategoryConfig& config = log.categories[(size_t)category];
+
+    size_t colon = value.find(':');
+    string policy = value.substr(0, colon);
+    int64_t param = -1;
+    if (colon != string::npos) {
+      param = 0;
+      for (size_t i = colon + 1; i < value.size(); ++i) {
+        if (value[i] < '0' or value[i] > '9' or param > 1000000000) {
+          return -1;
+        }
+        param = param * 10 + (value[i] - '0');
+      }
+    }
+
+    if (policy == "full" and param < 0) {
+      config.policy = Policy::FULL;
+    } else if (policy == "off" and param < 0) {
+      config.policy = Policy::OFF;
+    } else if (policy == "digest" and param < 0) {
+      config.policy = Policy::DIGEST;
+    } else if (policy == "truncate" and param >= 0) {
+      config.policy = Policy::TRUNCATE;
+    } else if (policy == "sample" and param > 0) {
+      config.policy = Policy::SAMPLE;
+    } else {
+      return -1;
+    }
+    config.param = (size_t)max<int64_t>(param, 0);
+  }
+  return 0;
+}
+
+void log_info(const string& line, LogCategory category) {
+  if (logger().level < LogLevel::INFO or !take_line(category)) {
+    return;
+  }
+  ALLOC_SCOPE(AllocTag::LOGGING);
+  logger().push(STDOUT_FILENO, line + "\n");
+}
+
+void log_debug(const string& line) {
+  if (logger().level < LogLevel::DEBUG) {
+    return;
+  }
+  ALLOC_SCOPE(AllocTag::LOGGING);
+  logger().push(STDOUT_FILENO, line + "\n");
+}
+
+void log_error(const string& line) {
+  ALLOC_SCOPE(AllocTag::LOGGING);
+  logger().push(STDERR_FILENO, line + "\n");
+}
+
+void log_values(LogCategory category, string_view prefix, string_view values,
+                string_view suffix) {
+  if (logger().level < LogLevel::INFO or !take_line(category)) {
+    return;
+  }
+  const CategoryConfig& config = logger().categories[(size_t)category];
+  ALLOC_SCOPE(AllocTag::LOGGING);
+
+  string line(prefix);
+  if (config.policy == Policy::DIGEST) {
+    size_t n_values = values.empty() ? 0 : 1;
+    for (char c : values) {
+      n_values += c == ' ';
+    }
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx",
+             (unsigned long long)digest(values));
+    line += "[" + to_string(n_values) + " values, digest " + hash + "]";
+  } else if (config.policy == Policy::TRUNCATE) {
+    // I cut before the space after the param-th value.
+    size_t cut = config.param == 0 ? 0 : values.size();
+    size_t n_spaces = 0;
+    for (size_t i = 0; i < values.size() and cut == values.size(); ++i) {
+      if (values[i] == ' ' and ++n_spaces == config.param) {
+        cut = i;
+      }
+    }
+    line += values.substr(0, cut);
+    if (cut < values.size()) {
+      line += cut > 0 ? " ..." : "...";
+    }
+  } else {
+    line += values;
+  }
+  line += suffix;
+  line += '\n';
+  logger().push(STDOUT_FILENO, std::move(line));
+}
+
+void log_flush() { logger().flush(); }
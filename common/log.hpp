@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Logging of both binaries. Lines are put into a lock-free queue and written
+// by a background thread in large batches, so the event loop never blocks on
+// stdout. With the default configuration the output is byte-identical to
+// writing every line with cout/cerr and endl.
+
+enum class LogLevel { ERROR, INFO, DEBUG };
+
+enum class LogCategory { GENERAL, STATE, PUT, N_CATEGORIES };
+
+// Comma separated settings, e.g. "level=info,state=digest,put=sample:100".
+//   level=error|info|debug  (default info)
+//   <category>=full|off|digest|truncate:<n>|sample:<n>  (default full)
+// where category is general, state or put. digest replaces the values of
+// a line by their number and a hash, truncate keeps the first n values and
+// sample logs every n-th line of the category.
+// returns -1 on error
+int log_configure(const string& spec);
+
+// Lines go to stdout, without the trailing newline.
+void log_info(const string& line, LogCategory category = LogCategory::GENERAL);
+void log_debug(const string& line);
+// Goes to stderr, always logged.
+void log_error(const string& line);
+// Logs prefix + values + suffix, where values are space separated numbers
+// that are shortened according to the category setting.
+void log_values(LogCategory category, string_view prefix, string_view values,
+                string_view suffix);
+
+// Waits until everything logged so far is written.
+void log_flush();
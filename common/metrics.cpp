@@ -0,0 +1,177 @@
+#include "metrics.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#include "utils.hpp"
+
+size_t Histogram::bucket_of(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return (size_t)value;
+  }
+  size_t msb = (size_t)bit_width(value) - 1;  // >= SUB_BITS
+  size_t shift = msb - SUB_BITS;
+  size_t sub = (size_t)(value >> shift) - SUB_BUCKETS;
+  return SUB_BUCKETS + shift * SUB_BUCKETS + sub;
+}
+
+uint64_t Histogram::bucket_upper(size_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  size_t shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+  uint64_t sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+  return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+uint64_t Histogram::quantile(double q) const {
+  uint64_t total = count.get();
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(q * (double)(total - 1)) + 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < N_BUCKETS; ++i) {
+    seen += buckets[i].load(memory_order_relaxed);
+    if (seen >= rank) {
+      return min(bucket_upper(i), max_value.load(memory_order_relaxed));
+    }
+  }
+  return max_value.load(memory_order_relaxed);
+}
+
+void Histogram::merge(const Histogram& other) {
+  for (size_t i = 0; i < N_BUCKETS; ++i) {
+    buckets[i].fetch_add(other.buckets[i].load(memory_order_relaxed),
+                         memory_order_relaxed);
+  }
+  count.add(other.count.get());
+  sum.add(other.sum.get());
+  uint64_t other_max = other.max_value.load(memory_order_relaxed);
+  if (other_max > max_value.load(memory_order_relaxed)) {
+    max_value.store(other_max, memory_order_relaxed);
+  }
+}
+
+Counter& MetricsRegistry::counter(const string& name, const string& help) {
+  counters.emplace_back();
+  entries.push_back({name, help, Type::COUNTER, &counters.back()});
+  return counters.back();
+}
+
+Gauge& MetricsRegistry::gauge(const string& name, const string& help) {
+  gauges.emplace_back();
+  entries.push_back({name, help, Type::GAUGE, &gauges.back()});
+  return gauges.back();
+}
+
+Histogram& MetricsRegistry::histogram(const string& name,
+                                      const string& help) {
+  histograms.emplace_back();
+  entries.push_back({name, help, Type::HISTOGRAM, &histograms.back()});
+  return histograms.back();
+}
+
+void MetricsRegistry::add_collector(function<string()> collector) {
+  collectors.push_back(std::move(collector));
+}
+
+string MetricsRegistry::dump() const {
+  static const pair<double, const char*> quantiles[] = {
+      {0.5, "0.5"}, {0.9, "0.9"}, {0.99, "0.99"}, {0.999, "0.999"}};
+  string res;
+  for (const Entry& entry : entries) {
+    res += "# HELP " + entry.name + " " + entry.help + "\n";
+    switch (entry.type) {
+      case Type::COUNTER:
+        res += "# TYPE " + entry.name + " counter\n";
+        res += entry.name + " " +
+               to_string(((const Counter*)entry.metric)->get()) + "\n";
+        break;
+      case Type::GAUGE:
+        res += "# TYPE " + entry.name + " gauge\n";
+        res += entry.name + " " +
+               to_string(((const Gauge*)entry.metric)->get()) + "\n";
+        break;
+      case Type::HISTOGRAM: {
+        // Summaries are much shorter than hundreds of Prometheus buckets.
+        const Histogram* hist = (const Histogram*)entry.metric;
+        res += "# TYPE " + entry.name + " summary\n";
+        for (const auto& [q, label] : quantiles) {
+          res += entry.name + "{quantile=\"" + label + "\"} " +
+                 to_string(hist->quantile(q)) + "\n";
+        }
+        res += entry.name + "{quantile=\"1\"} " +
+               to_string(hist->max_value.load(memory_order_relaxed)) + "\n";
+        res += entry.name + "_sum " + to_string(hist->sum.get()) + "\n";
+        res += entry.name + "_count " + to_string(hist->count.get()) + "\n";
+        break;
+      }
+    }
+  }
+  for (const auto& collector : collectors) {
+    res += collector();
+  }
+  return res;
+}
+
+MetricsRegistry& metrics() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+int start_stats_socket(const string& path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    print_error("stats socket path is too long: " + path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket_fd < 0) {
+    print_error("cannot create stats socket. errno: " + to_string(errno));
+    return -1;
+  }
+  unlink(path.c_str());  // A socket left by a previous run.
+  if (bind(socket_fd, (sockaddr*)&addr, sizeof(addr)) < 0 or
+      listen(socket_fd, 16) < 0) {
+    print_error("cannot listen on stats socket " + path +
+                ". errno: " + to_string(errno));
+    close(socket_fd);
+    return -1;
+  }
+
+  thread([socket_fd]() {
+    while (true) {
+      int client_fd = accept(socket_fd, NULL, NULL);
+      if (client_fd < 0) {
+        if (errno == EMFILE or errno == ENFILE or errno == ENOBUFS or
+            errno == ENOMEM) {
+          // accept fails right away until something is freed, so I wait
+          // instead of spinning.
+          this_thread::sleep_for(chrono::milliseconds(100));
+        }
+        continue;
+      }
+      string dump = metrics().dump();
+      size_t pos = 0;
+      while (pos < dump.size()) {
+        ssize_t res = write(client_fd, dump.data() + pos, dump.size() - pos);
+        if (res <= 0) {
+          break;
+        }
+        pos += (size_t)res;
+      }
+      close(client_fd);
+    }
+  }).detach();
+  return 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Metrics are updated by a single thread (the event loop) with plain relaxed
+// loads and stores, which cost about as much as incrementing an integer, and
+// can be read by any thread at any time.
+
+struct Counter {
+  atomic<uint64_t> value{0};
+
+  // Not an atomic read-modify-write: two threads adding to the same counter
+  // lose increments. Each counter has one writer.
+  void add(uint64_t n = 1) {
+    value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+  }
+  uint64_t get() const { return value.load(memory_order_relaxed); }
+};
+
+struct Gauge {
+  atomic<int64_t> value{0};
+
+  void set(int64_t n) { value.store(n, memory_order_relaxed); }
+  // One writer, like Counter::add.
+  void add(int64_t n) {
+    value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+  }
+  int64_t get() const { return value.load(memory_order_relaxed); }
+};
+
+// Log-linear (HDR style) histogram of non-negative integers: 16 buckets for
+// every power of two, so values are kept with about 6% precision.
+struct Histogram {
+  static constexpr size_t SUB_BITS = 4;
+  static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+  static constexpr size_t N_BUCKETS = SUB_BUCKETS * (64 - SUB_BITS + 1);
+
+  atomic<uint64_t> buckets[N_BUCKETS] = {};
+  Counter count;
+  Counter sum;
+  atomic<uint64_t> max_value{0};
+
+  static size_t bucket_of(uint64_t value);
+  // Highest value that falls into the bucket.
+  static uint64_t bucket_upper(size_t bucket);
+
+  void record(uint64_t value) {
+    atomic<uint64_t>& bucket = buckets[bucket_of(value)];
+    bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    count.add();
+    sum.add(value);
+    if (value > max_value.load(memory_order_relaxed)) {
+      max_value.store(value, memory_order_relaxed);
+    }
+  }
+  // q in [0, 1], returns 0 if there are no values
+  uint64_t quantile(double q) const;
+  // Adds the values of other, which no one may be recording to.
+  void merge(const Histogram& other);
+};
+
+// All metrics of the process, dumped in the Prometheus text format.
+class MetricsRegistry {
+  enum class Type { COUNTER, GAUGE, HISTOGRAM };
+  struct Entry {
+    string name;
+    string help;
+    Type type;
+    void* metric;
+  };
+  deque<Entry> entries;
+  deque<Counter> counters;  // deque, so references stay valid
+  deque<Gauge> gauges;
+  deque<Histogram> histograms;
+  vector<function<string()>> collectors;
+
+ public:
+  // Registration is meant for start-up, before other threads read metrics.
+  Counter& counter(const string& name, const string& help);
+  Gauge& gauge(const string& name, const string& help);
+  Histogram& histogram(const string& name, const string& help);
+  // Text the collector returns is appended to every dump, for metrics that
+  // are kept elsewhere. Like registration, before start_stats_socket.
+  void add_collector(function<string()> collector);
+
+  string dump() const;
+};
+
+MetricsRegistry& metrics();
+
+// Serves metrics().dump() to every client of a UNIX stream socket at path,
+// from a background thread.
+// returns -1 on error
+int start_stats_socket(const string& path);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+// Rules of the game the server enforces and the clients plan with.
+
+constexpr double PENALTY_POINTS = 20.0;  // Added to error for an early PUT
+constexpr double MAX_PUT_VALUE = 5.0;    // |value| of a proper PUT
+
+// Delays the server adds to replies on purpose.
+constexpr uint64_t STATE_DELAY_S_PER_SMALL_LETTER = 1;
+constexpr uint64_t COEFF_DELAY_S = 0;
+constexpr uint64_t PENALTY_DELAY_S = 0;
+constexpr uint64_t BAD_PUT_DELAY_S = 1;
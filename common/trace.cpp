@@ -0,0 +1,62 @@
+#include "trace.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace {
+// Rings are never freed, so a thread that exits still shows up in the dump.
+mutex rings_mutex;
+vector<unique_ptr<TraceRing>> rings;
+}  // namespace
+
+TraceRing& trace_ring() {
+  // The lock is taken only on the first trace point of each thread.
+  thread_local TraceRing* ring = [] {
+    lock_guard<mutex> lock(rings_mutex);
+    rings.push_back(make_unique<TraceRing>());
+    rings.back()->tid = (uint32_t)rings.size();
+    return rings.back().get();
+  }();
+  return *ring;
+}
+
+int trace_dump(const string& path) {
+  ofstream file(path, ios::trunc);
+  if (!file) {
+    print_error("cannot open trace file " + path + ".");
+    return -1;
+  }
+  file << fixed << setprecision(3) << "{\"traceEvents\":[";
+  bool first = true;
+  int pid = getpid();
+  lock_guard<mutex> lock(rings_mutex);
+  for (const auto& ring : rings) {
+    uint64_t head = ring->head.load(memory_order_acquire);
+    uint64_t begin = head - min<uint64_t>(head, TRACE_CAPACITY);
+    // Records of other threads may be overwritten while I read them, the
+    // oldest ones can be torn. That's fine for a diagnostic dump.
+    for (uint64_t i = begin; i < head; ++i) {
+      const TraceRecord& record = ring->records[i % TRACE_CAPACITY];
+      file << (first ? "\n" : ",\n") << "{\"name\":\"" << record.name
+           << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << ring->tid
+           << ",\"ts\":" << (double)record.begin_ns / 1000
+           << ",\"dur\":" << (double)(record.end_ns - record.begin_ns) / 1000
+           << "}";
+      first = false;
+    }
+  }
+  file << "\n]}\n";
+  if (!file) {
+    print_error("cannot write trace file " + path + ".");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Trace points are compiled in only with -DAPPROX_TRACE (make TRACE=1),
+// otherwise TRACE_SCOPE expands to nothing.
+//
+// TRACE_SCOPE("name") records the time spent until the end of the enclosing
+// scope. Records go to a ring buffer of the calling thread, which keeps the
+// last TRACE_CAPACITY of them, and are written as Chrome trace JSON
+// (chrome://tracing, ui.perfetto.dev) by trace_dump.
+
+struct TraceRecord {
+  const char* name;  // string literal
+  int64_t begin_ns;
+  int64_t end_ns;
+};
+
+constexpr size_t TRACE_CAPACITY = 1 << 16;
+
+// Written only by its thread, head is published with release so that
+// trace_dump can read the records from any thread.
+struct TraceRing {
+  TraceRecord records[TRACE_CAPACITY];
+  atomic<uint64_t> head{0};
+  uint32_t tid;
+
+  void push(const char* name, int64_t begin_ns, int64_t end_ns) {
+    uint64_t pos = head.load(memory_order_relaxed);
+    records[pos % TRACE_CAPACITY] = {name, begin_ns, end_ns};
+    head.store(pos + 1, memory_order_release);
+  }
+};
+
+TraceRing& trace_ring();
+
+inline int64_t trace_now_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct TraceScope {
+  const char* name;
+  int64_t begin_ns = trace_now_ns();
+
+  explicit TraceScope(const char* scope_name) : name(scope_name) {}
+  ~TraceScope() { trace_ring().push(name, begin_ns, trace_now_ns()); }
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+};
+
+#ifdef APPROX_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+constexpr bool TRACE_ENABLED = true;
+#else
+#define TRACE_SCOPE(name)
+constexpr bool TRACE_ENABLED = false;
+#endif
+
+// Writes the records of all threads to path (replacing it).
+// returns -1 on error
+int trace_dump(const string& path);
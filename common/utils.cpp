@@ -2,13 +2,15 @@
 
 #include <charconv>
 
+#include "log.hpp"
+
 void print_error(const string& description) {
-  cerr << "ERROR: " << description << endl;
+  log_error("ERROR: " + description);
 }
 
 string to_proper_rational(double val) {
   static const size_t buff_len = 1000;
-  static char buffer[buff_len];
+  char buffer[buff_len];  // Not static, clients call it from many threads
 
   auto res =
       to_chars(buffer, buffer + buff_len, val, std::chars_format::fixed, 7);
@@ -141,6 +143,37 @@ bool is_valid_scoring(const string& msg) {
   return true;
 }
 
+bool is_valid_compact_scoring(const string& msg) {
+  if (msg.size() <= 14 || msg.substr(0, 12) != "SCORING_TOP ") {
+    return false;
+  }
+  if (msg.substr(msg.size() - 2, 2) != "\r\n") {
+    return false;  // Must end with "\r\n"
+  }
+  // <rank> <error>, then <id> <error> for every top player.
+  string body = msg.substr(12, msg.size() - 14);
+  vector<string> words;
+  for (size_t start = 0;;) {
+    size_t end = body.find(' ', start);
+    words.push_back(body.substr(start, end - start));
+    if (end == string::npos) {
+      break;
+    }
+    start = end + 1;
+  }
+  if (words.size() % 2 != 0 or get_int(words[0], INT64_MAX) < 1) {
+    return false;
+  }
+  for (size_t i = 1; i < words.size(); ++i) {
+    bool valid = i % 2 == 1 ? is_proper_rational(words[i])
+                            : !words[i].empty() and is_id_valid(words[i]);
+    if (!valid) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // I assume that the integer non-negative
 int64_t get_int(const string& msg, int64_t mx) {
   int64_t res = 0;
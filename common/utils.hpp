@@ -26,6 +26,7 @@ vector<double> parse_coefficients(string& coeff_str);
 double get_double(const string& msg);
 
 bool is_valid_scoring(const string& msg);
+bool is_valid_compact_scoring(const string& msg);
 
 // I assume that the integer non-negative
 int64_t get_int(const string& msg, int64_t mx);
\ No newline at end of file
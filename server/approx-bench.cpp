@@ -0,0 +1,270 @@
+// Microbenchmarks of the protocol parsing, the game rules and the scoring.
+// Every case is calibrated to a batch of calls that takes about -t
+// milliseconds, run -w times to warm up and -r times measured. Percentiles of
+// the time per call go to stdout (or -o) as JSON, a table goes to stderr.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <unordered_set>
+
+#include "../common/utils.hpp"
+#include "game-engine.hpp"
+#include "utils-server.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+constexpr int64_t DEF_W = 3, MIN_W = 0, MAX_W = 1000;     // warmup runs
+constexpr int64_t DEF_R = 30, MIN_R = 1, MAX_R = 100000;  // measured runs
+constexpr int64_t DEF_T = 5, MIN_T = 1, MAX_T = 10000;    // ms per run
+
+// Realistic sizes: k up to MAX_K of the server, n + 1 coefficients with n up
+// to MAX_N, players of one room.
+const vector<int32_t> KS = {10, 100, 1000, 10000};
+const vector<int32_t> NS = {1, 4, 8};
+const vector<int32_t> PLAYER_COUNTS = {4, 100, 1000};
+
+// Keeps the compiler from optimizing away the benchmarked computation.
+template <class T>
+inline void keep(const T& value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+struct BenchResult {
+  string name;
+  string params;
+  uint64_t batch;
+  vector<double> ns_per_op;  // One value for every measured run, sorted
+
+  double percentile(double p) const {
+    size_t i = (size_t)(p * (double)(ns_per_op.size() - 1) + 0.5);
+    return ns_per_op[i];
+  }
+};
+
+struct Bench {
+  int64_t warmup;
+  int64_t reps;
+  milliseconds run_time;
+  string filter;  // Only cases with this substring in the name are run
+  vector<BenchResult> results;
+
+  static double run_batch(const function<void()>& op, uint64_t batch) {
+    auto begin = steady_clock::now();
+    for (uint64_t i = 0; i < batch; ++i) {
+      op();
+    }
+    return (double)duration_cast<nanoseconds>(steady_clock::now() - begin)
+        .count();
+  }
+
+  void run(const string& name, const string& params,
+           const function<void()>& op) {
+    if (name.find(filter) == string::npos) {
+      return;
+    }
+    // I double the batch until it takes at least the run time.
+    uint64_t batch = 1;
+    double target_ns = (double)duration_cast<nanoseconds>(run_time).count();
+    while (run_batch(op, batch) < target_ns and batch < (1ull << 40)) {
+      batch *= 2;
+    }
+    for (int64_t i = 0; i < warmup; ++i) {
+      run_batch(op, batch);
+    }
+    BenchResult result{name, params, batch, {}};
+    for (int64_t i = 0; i < reps; ++i) {
+      result.ns_per_op.push_back(run_batch(op, batch) / (double)batch);
+    }
+    sort(result.ns_per_op.begin(), result.ns_per_op.end());
+    fprintf(stderr,
+            "%-22s %-16s p50 %12.1f ns  p90 %12.1f ns  p99 %12.1f ns\n",
+            name.c_str(), params.c_str(), result.percentile(0.5),
+            result.percentile(0.9), result.percentile(0.99));
+    results.push_back(move(result));
+  }
+
+  string to_json() const {
+    string res = "{\"warmup\":" + to_string(warmup) +
+                 ",\"repetitions\":" + to_string(reps) + ",\"results\":[";
+    for (size_t i = 0; i < results.size(); ++i) {
+      const BenchResult& r = results[i];
+      res += i ? ",\n" : "\n";
+      res += "{\"name\":\"" + r.name + "\",\"params\":\"" + r.params +
+             "\",\"batch\":" + to_string(r.batch) +
+             ",\"ns_per_op\":{\"min\":" + to_string(r.ns_per_op.front()) +
+             ",\"p50\":" + to_string(r.percentile(0.5)) +
+             ",\"p90\":" + to_string(r.percentile(0.9)) +
+             ",\"p99\":" + to_string(r.percentile(0.99)) +
+             ",\"max\":" + to_string(r.ns_per_op.back()) + "}}";
+    }
+    res += "\n]}\n";
+    return res;
+  }
+};
+
+// Numbers as the server and the client send them.
+vector<string> random_rationals(mt19937_64& gen, size_t count) {
+  uniform_real_distribution<double> dist(-1000.0, 1000.0);
+  vector<string> res;
+  for (size_t i = 0; i < count; ++i) {
+    res.push_back(to_proper_rational(dist(gen)));
+  }
+  return res;
+}
+
+void bench_parsing(Bench& bench, mt19937_64& gen) {
+  vector<string> numbers = random_rationals(gen, 1024);
+  size_t i = 0;
+  bench.run("get_double", "", [&] {
+    keep(get_double(numbers[i++ % numbers.size()]));
+  });
+  bench.run("is_proper_rational", "", [&] {
+    keep(is_proper_rational(numbers[i++ % numbers.size()]));
+  });
+
+  uniform_real_distribution<double> dist(-1000.0, 1000.0);
+  vector<double> values(1024);
+  for (double& value : values) {
+    value = dist(gen);
+  }
+  bench.run("to_proper_rational", "", [&] {
+    keep(to_proper_rational(values[i++ % values.size()]));
+  });
+
+  for (int32_t n : NS) {
+    string coeff = "COEFF";
+    for (int32_t j = 0; j <= n; ++j) {
+      coeff += " " + numbers[(size_t)j];
+    }
+    coeff += "\r\n";
+    // parse_coefficients changes its argument for a while, so every call
+    // gets a copy.
+    bench.run("parse_coefficients", "n=" + to_string(n), [&] {
+      string copy = coeff;
+      keep(parse_coefficients(copy));
+    });
+  }
+
+  vector<string> puts;
+  uniform_int_distribution<int32_t> point(0, 10000);
+  uniform_real_distribution<double> value(-MAX_PUT_VALUE, MAX_PUT_VALUE);
+  for (size_t j = 0; j < 1024; ++j) {
+    puts.push_back("PUT " + to_string(point(gen)) + " " +
+                   to_proper_rational(value(gen)) + "\r\n");
+  }
+  bench.run("is_put", "", [&] { keep(is_put(puts[i++ % puts.size()])); });
+  bench.run("get_point_and_value", "", [&] {
+    keep(get_point_and_value(puts[i++ % puts.size()]));
+  });
+}
+
+void bench_game(Bench& bench, mt19937_64& gen) {
+  uniform_real_distribution<double> dist(-10.0, 10.0);
+  for (int32_t k : KS) {
+    string params = "k=" + to_string(k);
+    GamePlayer player;
+    player.hello("bench");
+    player.start(k);
+    for (double& value : player.approx) {
+      value = dist(gen);
+    }
+    bench.run("make_state", params, [&] { keep(make_state(player.approx)); });
+
+    for (int32_t n : NS) {
+      vector<double> coeffs((size_t)n + 1);
+      for (double& coeff : coeffs) {
+        coeff = dist(gen);
+      }
+      bench.run("set_coefficients", params + " n=" + to_string(n), [&] {
+        player.error = 0;
+        player.set_coefficients(coeffs);
+        keep(player.goal);
+      });
+    }
+
+    uniform_int_distribution<int64_t> point(0, k);
+    uniform_real_distribution<double> value(-MAX_PUT_VALUE, MAX_PUT_VALUE);
+    vector<pair<int64_t, double>> puts(1024);
+    for (auto& put : puts) {
+      put = {point(gen), value(gen)};
+    }
+    size_t i = 0;
+    bench.run("put", params, [&] {
+      auto [p, v] = puts[i++ % puts.size()];
+      keep(player.put(p, v, false));
+    });
+  }
+}
+
+void bench_scoring(Bench& bench, mt19937_64& gen) {
+  uniform_real_distribution<double> error(0.0, 1e6);
+  for (int32_t count : PLAYER_COUNTS) {
+    // The server is not set up, so there are no sockets, only players.
+    Server server(0, 10, false);
+    server.add_room(100, 4, 131, "");
+    server.pollvec.pollfds.assign((size_t)count + FIRST_CLIENT, {-1, 0, 0});
+    for (int32_t j = 0; j < count; ++j) {
+      Player player;
+      player.id = "benchPlayer" + to_string(j);
+      player.error = error(gen);
+      server.players.players.push_back(player);
+    }
+    bench.run("make_scoring", "players=" + to_string(count),
+              [&] { keep(server.make_scoring(0)); });
+  }
+}
+
+int main(int argc, char* argv[]) {
+  map<char, char*> args;
+
+  if (argc % 2 != 1) {
+    print_error("every option must have a value.");
+    return 1;
+  }
+
+  unordered_set<string> valid_args = {"-w", "-r", "-t", "-b", "-o"};
+
+  for (int i = 1; i < argc; i += 2) {
+    if (!valid_args.contains(argv[i])) {
+      print_error(string("invalid option ") + argv[i] + ".");
+      return 1;
+    }
+    if (args.contains(argv[i][1])) {
+      print_error(string("double parameter ") + argv[i] + ".");
+      return 1;
+    }
+    args[argv[i][1]] = argv[i + 1];
+  }
+
+  int64_t warmup = get_arg('w', args, DEF_W, MIN_W, MAX_W);
+  int64_t reps = get_arg('r', args, DEF_R, MIN_R, MAX_R);
+  int64_t run_ms = get_arg('t', args, DEF_T, MIN_T, MAX_T);
+  if (warmup < 0 or reps < 0 or run_ms < 0) {
+    return 1;
+  }
+
+  Bench bench{warmup, reps, milliseconds(run_ms),
+              args.contains('b') ? args['b'] : "", {}};
+  mt19937_64 gen(2024);  // Fixed seed, so runs are comparable
+  bench_parsing(bench, gen);
+  bench_game(bench, gen);
+  bench_scoring(bench, gen);
+
+  if (args.contains('o')) {
+    ofstream file(args['o']);
+    if (!(file << bench.to_json())) {
+      print_error("cannot write " + string(args['o']) + ".");
+      return 1;
+    }
+  } else {
+    cout << bench.to_json();
+  }
+  return 0;
+}
@@ -0,0 +1,304 @@
+// End-to-end benchmark on loopback: for every players count and k it starts
+// approx-server, connects that many approx-client -a players, waits until the
+// game ends and reports PUTs/s, the server's reply latency, its CPU time and
+// peak RSS and the time until all players finished. Results are JSON.
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../common/utils.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+constexpr int64_t DEF_M = 10000, MIN_M = 1, MAX_M = 12341234;
+constexpr int64_t DEF_N = 4, MIN_N = 1, MAX_N = 8;
+constexpr int64_t MAX_PLAYERS = 100000, MAX_K = 10000;
+const char* DEF_PLAYERS = "1,10,100";
+const char* DEF_KS = "10,100,1000";
+constexpr auto SERVER_START_TIMEOUT = seconds(5);
+
+struct RunResult {
+  int64_t players = 0;
+  int64_t k = 0;
+  double completion_s = 0;  // From starting the players to the last exit
+  int64_t failed_players = 0;
+  uint64_t puts = 0;
+  map<string, double> latency_us;  // Quantile label to value
+  double server_cpu_s = 0;
+  long server_peak_rss_kb = 0;
+
+  string to_json(int64_t m) const {
+    ostringstream res;
+    res << "{\"players\":" << players << ",\"k\":" << k << ",\"m\":" << m
+        << ",\"puts\":" << puts << ",\"puts_per_s\":"
+        << (completion_s > 0 ? (double)puts / completion_s : 0)
+        << ",\"completion_s\":" << completion_s
+        << ",\"failed_players\":" << failed_players
+        << ",\"reply_latency_us\":{";
+    bool first = true;
+    for (const auto& [label, value] : latency_us) {
+      res << (first ? "" : ",") << "\"" << label << "\":" << value;
+      first = false;
+    }
+    res << "},\"server_cpu_s\":" << server_cpu_s
+        << ",\"server_peak_rss_kb\":" << server_peak_rss_kb << "}";
+    return res.str();
+  }
+};
+
+// "1,10,100" -> {1, 10, 100}, returns {} on error
+vector<int64_t> parse_list(const string& list, int64_t mx) {
+  vector<int64_t> res;
+  istringstream words(list);
+  string word;
+  while (getline(words, word, ',')) {
+    int64_t value = get_int(word, mx);
+    if (value < 1) {
+      return {};
+    }
+    res.push_back(value);
+  }
+  return res;
+}
+
+// Starts the program with stdout and stderr sent to /dev/null.
+// returns -1 on error
+pid_t spawn(const vector<string>& argv) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    int dev_null = open("/dev/null", O_WRONLY);
+    dup2(dev_null, STDOUT_FILENO);
+    dup2(dev_null, STDERR_FILENO);
+    vector<char*> c_argv;
+    for (const string& arg : argv) {
+      c_argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    c_argv.push_back(NULL);
+    execv(c_argv[0], c_argv.data());
+    _exit(127);
+  }
+  if (pid < 0) {
+    print_error("cannot fork. errno: " + to_string(errno));
+  }
+  return pid;
+}
+
+// A port that was free a moment ago. returns -1 on error
+int32_t free_port() {
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  sockaddr_in6 addr{};
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  socklen_t len = sizeof(addr);
+  if (fd < 0 or bind(fd, (sockaddr*)&addr, len) < 0 or
+      getsockname(fd, (sockaddr*)&addr, &len) < 0) {
+    print_error("cannot find a free port. errno: " + to_string(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  close(fd);
+  return ntohs(addr.sin6_port);
+}
+
+// Whole metrics dump of the server, empty if it cannot be read.
+string read_stats(const string& path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+  string res;
+  if (fd >= 0 and connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+    char buffer[4096];
+    ssize_t len;
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+      res.append(buffer, (size_t)len);
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return res;
+}
+
+// Value of the sample "<key> <value>" in a Prometheus text dump, 0 if absent.
+double stat_value(const string& stats, const string& key) {
+  size_t pos = stats.find("\n" + key + " ");
+  if (pos == string::npos) {
+    return 0;
+  }
+  return atof(stats.c_str() + pos + key.size() + 2);
+}
+
+struct Loopback {
+  string bin_dir;
+  string coeff_file;
+  int64_t n;
+  int64_t m;
+
+  // returns -1 on error
+  int run(RunResult& result) {
+    int32_t port = free_port();
+    if (port < 0) {
+      return -1;
+    }
+    string stats_path =
+        "/tmp/approx-loopback-" + to_string(getpid()) + ".sock";
+    unlink(stats_path.c_str());
+    pid_t server =
+        spawn({bin_dir + "/approx-server", "-p", to_string(port), "-k",
+               to_string(result.k), "-n", to_string(n), "-m", to_string(m),
+               "-f", coeff_file, "-S", stats_path});
+    if (server < 0) {
+      return -1;
+    }
+    auto deadline = steady_clock::now() + SERVER_START_TIMEOUT;
+    while (read_stats(stats_path).empty()) {
+      if (steady_clock::now() > deadline) {
+        print_error("server did not start.");
+        kill(server, SIGKILL);
+        waitpid(server, NULL, 0);
+        return -1;
+      }
+      this_thread::sleep_for(milliseconds(10));
+    }
+
+    // Upper case ids have no small letters, so STATE is not delayed and the
+    // benchmark measures the server, not the intended delays.
+    auto begin = steady_clock::now();
+    vector<pid_t> players;
+    for (int64_t i = 0; i < result.players; ++i) {
+      pid_t pid = spawn({bin_dir + "/approx-client", "-u",
+                         "LOOPBACK" + to_string(i), "-s", "127.0.0.1", "-p",
+                         to_string(port), "-a"});
+      if (pid > 0) {
+        players.push_back(pid);
+      } else {
+        ++result.failed_players;
+      }
+    }
+    for (pid_t pid : players) {
+      int status;
+      if (waitpid(pid, &status, 0) < 0 or !WIFEXITED(status) or
+          WEXITSTATUS(status) != 0) {
+        ++result.failed_players;
+      }
+    }
+    result.completion_s =
+        duration<double>(steady_clock::now() - begin).count();
+
+    string stats = read_stats(stats_path);
+    result.puts = (uint64_t)stat_value(stats, "approx_puts_total");
+    const pair<string, string> quantiles[] = {
+        {"p50", "0.5"}, {"p90", "0.9"}, {"p99", "0.99"},
+        {"p999", "0.999"}, {"max", "1"}};
+    for (const auto& [name, label] : quantiles) {
+      result.latency_us[name] = stat_value(
+          stats, "approx_reply_latency_us{quantile=\"" + label + "\"}");
+    }
+
+    kill(server, SIGTERM);
+    int status;
+    rusage usage{};
+    wait4(server, &status, 0, &usage);
+    result.server_cpu_s =
+        (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+        (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    result.server_peak_rss_kb = usage.ru_maxrss;
+    unlink(stats_path.c_str());
+    return 0;
+  }
+};
+
+int main(int argc, char* argv[]) {
+  map<char, char*> args;
+
+  if (argc % 2 != 1) {
+    print_error("every option must have a value.");
+    return 1;
+  }
+
+  unordered_set<string> valid_args = {"-f", "-P", "-K", "-n",
+                                      "-m", "-d", "-o"};
+
+  for (int i = 1; i < argc; i += 2) {
+    if (!valid_args.contains(argv[i])) {
+      print_error(string("invalid option ") + argv[i] + ".");
+      return 1;
+    }
+    if (args.contains(argv[i][1])) {
+      print_error(string("double parameter ") + argv[i] + ".");
+      return 1;
+    }
+    args[argv[i][1]] = argv[i + 1];
+  }
+
+  int64_t n = get_arg('n', args, DEF_N, MIN_N, MAX_N);
+  int64_t m = get_arg('m', args, DEF_M, MIN_M, MAX_M);
+  if (n < 0 or m < 0) {
+    return 1;
+  }
+  if (!args.contains('f')) {
+    print_error("option -f is mandatory.");
+    return 1;
+  }
+  vector<int64_t> player_counts =
+      parse_list(args.contains('P') ? args['P'] : DEF_PLAYERS, MAX_PLAYERS);
+  vector<int64_t> ks = parse_list(args.contains('K') ? args['K'] : DEF_KS,
+                                  MAX_K);
+  if (player_counts.empty() or ks.empty()) {
+    print_error("-P and -K take comma separated positive integers.");
+    return 1;
+  }
+
+  Loopback loopback{args.contains('d') ? args['d'] : ".", args['f'], n, m};
+  string res = "{\"results\":[";
+  bool first = true;
+  for (int64_t k : ks) {
+    for (int64_t players : player_counts) {
+      RunResult result;
+      result.players = players;
+      result.k = k;
+      if (loopback.run(result) < 0) {
+        return 1;
+      }
+      cerr << "k " << k << ", players " << players << ": " << result.puts
+           << " PUTs in " << result.completion_s << " s, p99 reply "
+           << result.latency_us["p99"] << " us, server CPU "
+           << result.server_cpu_s << " s, peak RSS "
+           << result.server_peak_rss_kb << " KB.\n";
+      res += (first ? "\n" : ",\n") + result.to_json(m);
+      first = false;
+    }
+  }
+  res += "\n]}\n";
+
+  if (args.contains('o')) {
+    ofstream file(args['o']);
+    if (!(file << res)) {
+      print_error("cannot write " + string(args['o']) + ".");
+      return 1;
+    }
+  } else {
+    cout << res;
+  }
+  return 0;
+}
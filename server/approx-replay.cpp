@@ -0,0 +1,241 @@
+// Replays a journal written by approx-server -j into the server logic in this
+// process: every connection of the journal gets a socketpair, and its bytes
+// are written in the recorded chunks, each followed by one iteration of the
+// event loop, so the server reads them exactly as it did. Replies are read
+// and dropped. With -s 1 records keep their original spacing, with -s 0 they
+// come as fast as the server takes them, on a manual game clock set to the
+// time of every record, so delayed replies go out between the same records.
+// The report (JSON) has the replay throughput and the server's metrics.
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <unordered_set>
+
+#include "../common/utils.hpp"
+#include "journal.hpp"
+#include "utils-server.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+constexpr int64_t DEF_K = 100, MIN_K = 1, MAX_K = 10000;
+constexpr int64_t DEF_N = 4, MIN_N = 1, MAX_N = 8;
+constexpr int64_t DEF_M = 131, MIN_M = 1, MAX_M = 12341234;
+constexpr int64_t DEF_T = 10, MIN_T = 1, MAX_T = 1000;
+constexpr int64_t DEF_L = 0, MIN_L = 0, MAX_L = 1;
+constexpr int64_t DEF_S = 1, MIN_S = 0, MAX_S = 1;
+
+struct Replay {
+  Server& server;
+  bool original_speed;
+  map<uint64_t, int> peers;  // Journal connection to our end of its pair
+  uint64_t records = 0, connections = 0, bytes_in = 0, bytes_out = 0;
+  TimePoint next_event;
+
+  Replay(Server& _server, bool _original_speed)
+      : server(_server), original_speed(_original_speed) {
+    next_event = server.start_waiting_rooms(game_clock().now() + seconds(1));
+  }
+
+  // returns -1 on error
+  int apply(const JournalEntry& entry) {
+    ++records;
+    switch (entry.type) {
+      case JournalType::CONNECT:
+        return connect(entry);
+      case JournalType::DATA: {
+        auto peer = peers.find(entry.connection);
+        if (peer == peers.end()) {
+          return 0;  // The server closed it, like it did when recording
+        }
+        bytes_in += entry.data.size();
+        // The server may have closed its end, then this just fails.
+        send(peer->second, entry.data.data(), entry.data.size(),
+             MSG_NOSIGNAL);
+        break;
+      }
+      case JournalType::CLOSE: {
+        auto peer = peers.find(entry.connection);
+        if (peer != peers.end()) {
+          close(peer->second);
+          peers.erase(peer);
+        }
+        break;
+      }
+    }
+    step(game_clock().now());  // The server reads what was just sent
+    return 0;
+  }
+
+  // Runs the event loop until the time comes and nothing is due, e.g. lines
+  // left over by the message budget.
+  void step(TimePoint until) {
+    GameClock& clock = game_clock();
+    if (clock.mode == ClockMode::MANUAL) {
+      // Every deadline before until is handled at its own time.
+      while (true) {
+        next_event = server.run_once(next_event);
+        drain();
+        if (next_event > clock.now()) {
+          if (next_event > until) {
+            break;
+          }
+          clock.advance(next_event);
+        }
+      }
+      clock.advance(until);
+      return;
+    }
+    do {
+      next_event = server.run_once(min(next_event, until));
+      drain();
+    } while (clock.now() < until or next_event <= clock.now());
+  }
+
+ private:
+  int connect(const JournalEntry& entry) {
+    int fd = server.add_socketpair_client(entry.ip, entry.port);
+    if (fd < 0) {
+      return -1;
+    }
+    ++connections;
+    peers[entry.connection] = fd;
+    return 0;
+  }
+
+  // Reads and drops the replies, forgets connections the server closed.
+  void drain() {
+    static char buffer[1 << 16];
+    for (auto peer = peers.begin(); peer != peers.end();) {
+      ssize_t len;
+      while ((len = read(peer->second, buffer, sizeof(buffer))) > 0) {
+        bytes_out += (uint64_t)len;
+      }
+      if (len == 0) {
+        close(peer->second);
+        peer = peers.erase(peer);
+      } else {
+        ++peer;
+      }
+    }
+  }
+};
+
+int main(int argc, char* argv[]) {
+  map<char, char*> args;
+
+  if (argc % 2 != 1) {
+    print_error("every option must have a value.");
+    return 1;
+  }
+
+  unordered_set<string> valid_args = {"-j", "-f", "-k", "-n", "-m",
+                                      "-t", "-l", "-s", "-L", "-o"};
+
+  for (int i = 1; i < argc; i += 2) {
+    if (!valid_args.contains(argv[i])) {
+      print_error(string("invalid option ") + argv[i] + ".");
+      return 1;
+    }
+    if (args.contains(argv[i][1])) {
+      print_error(string("double parameter ") + argv[i] + ".");
+      return 1;
+    }
+    args[argv[i][1]] = argv[i + 1];
+  }
+  if (!args.contains('j') or !args.contains('f')) {
+    print_error("options -j and -f are mandatory.");
+    return 1;
+  }
+
+  int64_t k = get_arg('k', args, DEF_K, MIN_K, MAX_K);
+  int64_t n = get_arg('n', args, DEF_N, MIN_N, MAX_N);
+  int64_t m = get_arg('m', args, DEF_M, MIN_M, MAX_M);
+  int64_t t = get_arg('t', args, DEF_T, MIN_T, MAX_T);
+  int64_t l = get_arg('l', args, DEF_L, MIN_L, MAX_L);
+  int64_t speed = get_arg('s', args, DEF_S, MIN_S, MAX_S);
+  if (k < 0 or n < 0 or m < 0 or t < 0 or l < 0 or speed < 0) {
+    return 1;
+  }
+  // Game lines of a long journal would drown the report.
+  if (log_configure(args.contains('L') ? args['L']
+                                       : "general=off,state=off") < 0) {
+    print_error(string("invalid log setting ") + args['L'] + ".");
+    return 1;
+  }
+
+  JournalReader journal;
+  if (journal.open(args['j']) < 0) {
+    return 1;
+  }
+  if (speed == 0) {
+    game_clock().set_mode(ClockMode::MANUAL);
+  }
+  // Port 0: the listening socket gets any free port and nobody connects.
+  Server server(0, (int32_t)t, l == 1);
+  server.add_room((int32_t)k, (int32_t)n, (int32_t)m, args['f']);
+  if (server.set_up() < 0) {
+    return 1;
+  }
+
+  Replay replay(server, speed == 1);
+  JournalEntry entry;
+  int res;
+  auto start = steady_clock::now();
+  TimePoint clock_start = game_clock().now();
+  while ((res = journal.next(entry)) == 1) {
+    replay.step(clock_start + entry.at);
+    if (replay.apply(entry) < 0) {
+      return 1;
+    }
+  }
+  if (res < 0) {
+    return 1;
+  }
+  double seconds = duration<double>(steady_clock::now() - start).count();
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double cpu_s = (double)usage.ru_utime.tv_sec + (double)usage.ru_stime.tv_sec +
+                 (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) /
+                     1e6;
+
+  ServerMetrics& stats = server_metrics();
+  auto quantiles = [](const Histogram& histogram) {
+    return "{\"p50\":" + to_string(histogram.quantile(0.5)) +
+           ",\"p99\":" + to_string(histogram.quantile(0.99)) +
+           ",\"max\":" + to_string(histogram.quantile(1)) + "}";
+  };
+  ostringstream report;
+  report << "{\"records\":" << replay.records
+         << ",\"connections\":" << replay.connections
+         << ",\"bytes_in\":" << replay.bytes_in
+         << ",\"bytes_out\":" << replay.bytes_out
+         << ",\"original_speed\":" << (replay.original_speed ? "true" : "false")
+         << ",\"seconds\":" << seconds
+         << ",\"records_per_s\":" << (double)replay.records / seconds
+         << ",\"puts\":" << stats.puts.get()
+         << ",\"puts_per_s\":" << (double)stats.puts.get() / seconds
+         << ",\"penalties\":" << stats.penalties.get()
+         << ",\"bad_puts\":" << stats.bad_puts.get() << ",\"cpu_s\":" << cpu_s
+         << ",\"loop_iteration_us\":" << quantiles(stats.loop_iteration_us)
+         << ",\"reply_latency_us\":" << quantiles(stats.reply_latency_us)
+         << "}\n";
+  log_flush();
+  if (args.contains('o')) {
+    ofstream out(args['o']);
+    out << report.str();
+    if (!out) {
+      print_error(string("cannot write ") + args['o'] + ".");
+      return 1;
+    }
+  } else {
+    cout << report.str();
+  }
+  return 0;
+}
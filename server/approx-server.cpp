@@ -1,8 +1,11 @@
 #include <poll.h>
+#include <sched.h>
 
 #include <cstdint>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <map>
 #include <stdexcept>
 #include <unordered_set>
@@ -16,6 +19,53 @@ constexpr int64_t DEF_P = 0, MIN_P = 0, MAX_P = 65535;
 constexpr int64_t DEF_K = 100, MIN_K = 1, MAX_K = 10000;
 constexpr int64_t DEF_N = 4, MIN_N = 1, MAX_N = 8;
 constexpr int64_t DEF_M = 131, MIN_M = 1, MAX_M = 12341234;
+constexpr int64_t DEF_T = 10, MIN_T = 1, MAX_T = 1000;
+constexpr int64_t DEF_L = 0, MIN_L = 0, MAX_L = 1;
+constexpr int64_t DEF_I = 1000, MIN_I = 1, MAX_I = 3600000;
+// Output queued for one client, 0 is no cap.
+constexpr int64_t DEF_B = 16 << 20, MIN_B = 0, MAX_B = 1ll << 40;
+constexpr int64_t DEF_Q = 4096, MIN_Q = 0, MAX_Q = 1 << 30;
+constexpr int64_t DEF_X = 0, MIN_X = 0, MAX_X = 1;
+constexpr int64_t DEF_V = 0, MIN_V = 0, MAX_V = 1;
+constexpr int64_t DEF_BUSY = 0, MIN_BUSY = 0, MAX_BUSY = 1000000;
+constexpr int64_t MAX_CPU = CPU_SETSIZE - 1;
+// Admission limits, 0 is no limit.
+constexpr int64_t DEF_N_CONN = 0, MIN_N_CONN = 0, MAX_N_CONN = 1 << 30;
+constexpr int64_t DEF_H = 0, MIN_H = 0, MAX_H = 1 << 30;
+constexpr int64_t DEF_I_IP = 0, MIN_I_IP = 0, MAX_I_IP = 1 << 30;
+
+// Every line of the rooms file describes one more room: <k> <n> <m> <file>
+// returns -1 on error
+int add_rooms_from_file(Server& server, const char* rooms_file) {
+  ifstream file(rooms_file);
+  if (!file) {
+    print_error("cannot open file: " + string(rooms_file));
+    return -1;
+  }
+  string line;
+  for (size_t line_no = 1; getline(file, line); ++line_no) {
+    if (!line.empty() and line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty()) {
+      continue;
+    }
+    istringstream words(line);
+    string k_str, n_str, m_str, coeff_file;
+    words >> k_str >> n_str >> m_str >> coeff_file;
+
+    int64_t k = get_int(k_str, MAX_K);
+    int64_t n = get_int(n_str, MAX_N);
+    int64_t m = get_int(m_str, MAX_M);
+    if (k < MIN_K or n < MIN_N or m < MIN_M or coeff_file.empty()) {
+      print_error("invalid room in line " + to_string(line_no) + " of " +
+                  rooms_file + ".");
+      return -1;
+    }
+    server.add_room((int32_t)k, (int32_t)n, (int32_t)m, coeff_file);
+  }
+  return 0;
+}
 
 int main(int argc, char* argv[]) {
   map<char, char*> args;
@@ -25,7 +75,12 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  unordered_set<string> valid_args = {"-p", "-k", "-n", "-m", "-f"};
+  unordered_set<string> valid_args = {"-p", "-k", "-n", "-m", "-f",
+                                      "-t", "-l", "-r",
+                                      "-c", "-i", "-L", "-S", "-T",
+                                      "-j", "-b", "-q", "-P",
+                                      "-N", "-H", "-I", "-U",
+                                      "-x", "-B", "-C", "-V"};
 
   for (int i = 1; i < argc; i += 2) {
     if (!valid_args.contains(argv[i])) {
@@ -39,35 +94,129 @@ int main(int argc, char* argv[]) {
     args[argv[i][1]] = argv[i + 1];
   }
 
+  if (args.contains('L') and log_configure(args['L']) < 0) {
+    print_error(string("invalid log setting ") + args['L'] + ".");
+    return 1;
+  }
+
   int32_t port;
   int32_t k;
   int32_t n;
   int32_t m;
+  int32_t t;
+  int32_t l;
+  int32_t interval;
+  int64_t max_bytes, max_messages;
+  int64_t max_connections, max_pre_hello, max_per_ip;
+  int64_t low_latency, busy_poll_us, cpu = -1, virtual_clock;
   char* f = NULL;
 
   port = (int32_t)get_arg('p', args, DEF_P, MIN_P, MAX_P);
   k = (int32_t)get_arg('k', args, DEF_K, MIN_K, MAX_K);
   n = (int32_t)get_arg('n', args, DEF_N, MIN_N, MAX_N);
   m = (int32_t)get_arg('m', args, DEF_M, MIN_M, MAX_M);
+  t = (int32_t)get_arg('t', args, DEF_T, MIN_T, MAX_T);
+  l = (int32_t)get_arg('l', args, DEF_L, MIN_L, MAX_L);
+  interval = (int32_t)get_arg('i', args, DEF_I, MIN_I, MAX_I);
+  max_bytes = get_arg('b', args, DEF_B, MIN_B, MAX_B);
+  max_messages = get_arg('q', args, DEF_Q, MIN_Q, MAX_Q);
+  max_connections = get_arg('N', args, DEF_N_CONN, MIN_N_CONN, MAX_N_CONN);
+  max_pre_hello = get_arg('H', args, DEF_H, MIN_H, MAX_H);
+  max_per_ip = get_arg('I', args, DEF_I_IP, MIN_I_IP, MAX_I_IP);
+  low_latency = get_arg('x', args, DEF_X, MIN_X, MAX_X);
+  busy_poll_us = get_arg('B', args, DEF_BUSY, MIN_BUSY, MAX_BUSY);
+  virtual_clock = get_arg('V', args, DEF_V, MIN_V, MAX_V);
+  if (args.contains('C') and (cpu = get_arg('C', args, 0, 0, MAX_CPU)) < 0) {
+    return 1;
+  }
 
-  if (port < 0 or k < 0 or n < 0 or m < 0) {
+  if (port < 0 or k < 0 or n < 0 or m < 0 or t < 0 or l < 0 or
+      interval < 0 or max_bytes < 0 or max_messages < 0 or
+      max_connections < 0 or max_pre_hello < 0 or max_per_ip < 0 or
+      low_latency < 0 or busy_poll_us < 0 or virtual_clock < 0) {
     return 1;
   }
 
+  OutputPolicy policy = OutputPolicy::DISCONNECT;
+  if (args.contains('P')) {
+    string name = args['P'];
+    if (name == "coalesce") {
+      policy = OutputPolicy::COALESCE;
+    } else if (name != "disconnect") {
+      print_error("option -P takes disconnect or coalesce.");
+      return 1;
+    }
+  }
+
   if (!args.contains('f')) {
     print_error("option -f is mandatory.");
     return 1;
   }
   f = args['f'];
 
-  Server server((uint16_t)port, k, n, m, f);
+  if (virtual_clock == 1) {
+    game_clock().set_mode(ClockMode::VIRTUAL);
+  }
+  Server server((uint16_t)port, t, l == 1);
+  server.add_room(k, n, m, f);  // Room 0 comes from the command line.
+  if (args.contains('r') and add_rooms_from_file(server, args['r']) < 0) {
+    return 1;
+  }
+  server.output_limits = {(size_t)max_bytes, (size_t)max_messages, policy};
+  if (args.contains('U')) {
+    server.pollvec.unix_path = args['U'];
+  }
+  server.admission = {(size_t)max_connections, (size_t)max_pre_hello,
+                      (size_t)max_per_ip};
+  server.low_latency = low_latency == 1;
+  server.pollvec.deadline_timer = low_latency == 1 and cpu < 0;
+  server.busy_poll_us = (int)busy_poll_us;
+  server.spin = cpu >= 0;
+  if (args.contains('c')) {
+    server.checkpoint_path = args['c'];
+    server.checkpoint_interval = milliseconds(interval);
+  }
+  if (args.contains('T')) {
+    if (!TRACE_ENABLED) {
+      print_error("option -T needs trace points, build with make TRACE=1.");
+      return 1;
+    }
+    server.trace_path = args['T'];
+  }
   if (server.set_up() < 0) {
     return 1;
   }
+  if (args.contains('j') and server.journal.open(args['j']) < 0) {
+    return 1;
+  }
+  // The end of the log and of the journal is still in memory, so I stop
+  // cleanly.
+  signal(SIGINT, [](int) { stop_requested = 1; });
+  signal(SIGTERM, [](int) { stop_requested = 1; });
+  // Collectors are registered before the stats thread reads them.
+  if (ALLOC_STATS_ENABLED) {
+    metrics().add_collector(
+        [] { return alloc_stats_dump(server_metrics().puts.get()); });
+  }
+  if (args.contains('S') and start_stats_socket(args['S']) < 0) {
+    return 1;
+  }
+  signal(SIGUSR1, [](int) { metrics_dump_requested = 1; });
 
-  while (true) {
-    server.play_a_game();
-    sleep(1);  // Sleep for 1 second before the next game
+  if (cpu >= 0) {
+    // Only the event loop spins there. Threads started later would inherit
+    // the CPU, so the log writer starts now.
+    log_flush();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((int)cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+      print_error("cannot pin to CPU " + to_string(cpu) + ": " +
+                  strerror(errno));
+      return 1;
+    }
   }
+  server.run();
+  log_flush();
   return 0;
 }
\ No newline at end of file
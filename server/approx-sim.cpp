@@ -0,0 +1,215 @@
+// In-process simulation of many games with the rules from game-engine, no
+// sockets and no real time. Used to evaluate strategies and to benchmark the
+// rules themselves.
+
+#include <math.h>
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <queue>
+#include <thread>
+#include <unordered_set>
+
+#include "../client/strategy.hpp"
+#include "../common/utils.hpp"
+#include "game-engine.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+constexpr int64_t DEF_K = 100, MIN_K = 1, MAX_K = 10000;
+constexpr int64_t DEF_M = 131, MIN_M = 1, MAX_M = 12341234;
+constexpr int64_t DEF_P = 100, MIN_P = 1, MAX_P = 100000;  // players
+constexpr int64_t DEF_G = 1000, MIN_G = 1, MAX_G = 100000000;
+constexpr int64_t DEF_J = 1, MIN_J = 1, MAX_J = 256;
+constexpr int64_t DEF_E = 0, MIN_E = 0, MAX_E = 100;  // % of eager players
+
+// Eager players do not wait for replies and PUT every half a second.
+constexpr double EAGER_PERIOD_S = 0.5;
+
+struct SimPlayer {
+  GamePlayer game;
+  GreedyPlan strategy;  // The greedy strategy of approx-client -a
+  bool eager = false;
+  double replies_until = 0.0;  // Time when the last queued reply is sent
+};
+
+struct SimStats {
+  uint64_t games = 0;
+  uint64_t puts = 0;
+  uint64_t penalties = 0;
+  double virtual_s = 0.0;
+  double error_sum[2] = {0.0, 0.0};  // [eager]
+  uint64_t players[2] = {0, 0};
+
+  void add(const SimStats& other) {
+    games += other.games;
+    puts += other.puts;
+    penalties += other.penalties;
+    virtual_s += other.virtual_s;
+    for (size_t i = 0; i < 2; ++i) {
+      error_sum[i] += other.error_sum[i];
+      players[i] += other.players[i];
+    }
+  }
+};
+
+struct Simulation {
+  int32_t k, m;
+  size_t n_players;
+  int64_t eager_percent;
+  vector<vector<double>> coefficients;
+
+  // Plays one game, coefficients are taken from line first_coeff on.
+  void play_game(size_t first_coeff, SimStats& stats) const {
+    vector<SimPlayer> players(n_players);
+    using Event = pair<double, size_t>;  // (time, player)
+    priority_queue<Event, vector<Event>, greater<Event>> events;
+
+    for (size_t i = 0; i < n_players; ++i) {
+      SimPlayer& p = players[i];
+      // 1 to 4 small letters, so STATE delays differ between players.
+      p.game.hello(string(1 + i % 4, 's') + "P" + to_string(i));
+      p.game.start(k);
+      const vector<double>& coeffs =
+          coefficients[(first_coeff + i) % coefficients.size()];
+      p.game.set_coefficients(coeffs);
+      p.strategy.start(coeffs, k);
+      p.eager = (int64_t)(i % 100) < eager_percent;
+      events.push({0.0, i});
+    }
+
+    int32_t counter_m = 0;
+    double now = 0.0;
+    while (counter_m < m and !events.empty()) {
+      auto [time, i] = events.top();
+      events.pop();
+      now = time;
+      SimPlayer& p = players[i];
+
+      auto [point, value] = p.strategy.next();
+      PutResult result = p.game.put(point, value, now < p.replies_until);
+      ++stats.puts;
+
+      double reply_at = now;
+      if (result.penalty) {
+        ++stats.penalties;
+        reply_at = max(reply_at, now + (double)PENALTY_DELAY_S);
+      }
+      if (result.bad_put) {
+        reply_at = max(reply_at, now + (double)BAD_PUT_DELAY_S);
+      }
+      if (result.state) {
+        ++counter_m;
+        reply_at = max(reply_at, now + (double)p.game.state_delay_s());
+      }
+      p.replies_until = max(p.replies_until, reply_at);
+      events.push({p.eager ? now + EAGER_PERIOD_S : p.replies_until, i});
+    }
+
+    ++stats.games;
+    stats.virtual_s += now;
+    for (const SimPlayer& p : players) {
+      stats.error_sum[p.eager] += p.game.error;
+      ++stats.players[p.eager];
+    }
+  }
+};
+
+int main(int argc, char* argv[]) {
+  map<char, char*> args;
+
+  if (argc % 2 != 1) {
+    print_error("every option must have a value.");
+    return 1;
+  }
+
+  unordered_set<string> valid_args = {"-k", "-m", "-f", "-P",
+                                      "-g", "-j", "-e"};
+
+  for (int i = 1; i < argc; i += 2) {
+    if (!valid_args.contains(argv[i])) {
+      print_error(string("invalid option ") + argv[i] + ".");
+      return 1;
+    }
+    if (args.contains(argv[i][1])) {
+      print_error(string("double parameter ") + argv[i] + ".");
+      return 1;
+    }
+    args[argv[i][1]] = argv[i + 1];
+  }
+
+  int64_t k = get_arg('k', args, DEF_K, MIN_K, MAX_K);
+  int64_t m = get_arg('m', args, DEF_M, MIN_M, MAX_M);
+  int64_t players = get_arg('P', args, DEF_P, MIN_P, MAX_P);
+  int64_t games = get_arg('g', args, DEF_G, MIN_G, MAX_G);
+  int64_t threads = get_arg('j', args, DEF_J, MIN_J, MAX_J);
+  int64_t eager = get_arg('e', args, DEF_E, MIN_E, MAX_E);
+  if (k < 0 or m < 0 or players < 0 or games < 0 or threads < 0 or
+      eager < 0) {
+    return 1;
+  }
+  if (!args.contains('f')) {
+    print_error("option -f is mandatory.");
+    return 1;
+  }
+
+  Simulation sim{(int32_t)k, (int32_t)m, (size_t)players, eager, {}};
+  ifstream file(args['f']);
+  if (!file) {
+    print_error("cannot open file: " + string(args['f']));
+    return 1;
+  }
+  string line;
+  while (getline(file, line)) {
+    if (!line.empty() and line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty()) {
+      continue;
+    }
+    if (line[0] != 'C') {
+      line = "COEFF " + line;
+    }
+    line += "\r\n";
+    sim.coefficients.push_back(parse_coefficients(line));
+  }
+  if (sim.coefficients.empty()) {
+    print_error("no coefficients in " + string(args['f']) + ".");
+    return 1;
+  }
+
+  vector<SimStats> thread_stats((size_t)threads);
+  vector<thread> workers;
+  auto start = steady_clock::now();
+  for (size_t t = 0; t < (size_t)threads; ++t) {
+    workers.emplace_back([&, t]() {
+      for (size_t g = t; g < (size_t)games; g += (size_t)threads) {
+        sim.play_game(g * (size_t)players, thread_stats[t]);
+      }
+    });
+  }
+  SimStats stats;
+  for (size_t t = 0; t < (size_t)threads; ++t) {
+    workers[t].join();
+    stats.add(thread_stats[t]);
+  }
+  double wall_s = duration<double>(steady_clock::now() - start).count();
+
+  cout << "Simulated " << stats.games << " games, " << stats.puts
+       << " puts in " << wall_s << " s: " << (double)stats.games / wall_s
+       << " games/s, " << (double)stats.puts / wall_s << " puts/s." << endl;
+  cout << "Average game length " << stats.virtual_s / (double)stats.games
+       << " s of game time, " << stats.penalties << " penalties." << endl;
+  const char* names[2] = {"waiting", "eager"};
+  for (size_t i = 0; i < 2; ++i) {
+    if (stats.players[i] > 0) {
+      cout << "Average error of " << names[i] << " players: "
+           << stats.error_sum[i] / (double)stats.players[i] << "." << endl;
+    }
+  }
+  return 0;
+}
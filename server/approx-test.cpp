@@ -0,0 +1,150 @@
+// Checks of how the server handles what clients send, run by make check.
+// Like approx-replay, the server logic runs in this process on a manual game
+// clock, and the client is our end of a socketpair. Every failed check is
+// printed, the exit code is 1 if any failed.
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "../common/log.hpp"
+#include "../common/utils.hpp"
+#include "utils-server.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const string& what, const string& got) {
+  if (!ok) {
+    ++failures;
+    cerr << "FAILED: " << what << ", got: '" << got << "'" << endl;
+  }
+}
+
+struct TestClient {
+  Server& server;
+  TimePoint next_event;
+  int fd = -1;
+
+  explicit TestClient(Server& _server) : server(_server) {
+    next_event = server.start_waiting_rooms(game_clock().now());
+  }
+
+  // returns -1 on error
+  int connect() {
+    fd = server.add_socketpair_client("test", 0);
+    return fd < 0 ? -1 : 0;
+  }
+
+  // Sends the chunks one server iteration apart, lets two seconds of game
+  // time pass (longer than every reply delay of an uppercase id) and returns
+  // what the server replied.
+  string exchange(const vector<string>& chunks) {
+    for (const string& chunk : chunks) {
+      if (write(fd, chunk.data(), chunk.size()) != (ssize_t)chunk.size()) {
+        print_error("cannot write to the server.");
+      }
+      next_event = server.run_once(next_event);
+    }
+    for (int i = 0; i < 3; ++i) {
+      game_clock().advance(game_clock().now() + seconds(1));
+      next_event = server.run_once(next_event);
+    }
+    string reply;
+    char buffer[1 << 16];
+    ssize_t len;
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+      reply.append(buffer, (size_t)len);
+    }
+    return reply;
+  }
+};
+
+}  // namespace
+
+int main() {
+  char coeff_path[] = "/tmp/approx-test-XXXXXX";
+  int coeff_fd = mkstemp(coeff_path);
+  string coeffs = "COEFF 1 2\r\nCOEFF 3 4\r\n";
+  if (coeff_fd < 0 or write(coeff_fd, coeffs.data(), coeffs.size()) !=
+                          (ssize_t)coeffs.size()) {
+    print_error("cannot write the coefficients file.");
+    return 1;
+  }
+  close(coeff_fd);
+  log_configure("general=off,state=off");
+
+  game_clock().set_mode(ClockMode::MANUAL);
+  Server server(0, 10, false);
+  server.add_room(10, 1, 100, coeff_path);
+  if (server.set_up() < 0) {
+    return 1;
+  }
+  TestClient client(server);
+  if (client.connect() < 0) {
+    return 1;
+  }
+
+  string reply = client.exchange({"HELLO TEST\r\n"});
+  check(reply.starts_with("COEFF 1 2\r\n"), "COEFF after HELLO", reply);
+
+  // Leading zeros are legal, however many of them there are.
+  reply = client.exchange({"PUT 1 " + string(30, '0') + "1\r\n"});
+  check(reply.starts_with("STATE 0.0000000 1.0000000 "),
+        "STATE for a PUT with 30 leading zeros", reply);
+
+  // Longer than MAX_PUT_LENGTH: BAD_PUT with the value cut short.
+  string zeros(2 * MAX_PUT_LENGTH, '0');
+  reply = client.exchange({"PUT 2 " + zeros + "1\r\n"});
+  check(reply.starts_with("BAD_PUT 2 000") and reply.ends_with("0\r\n") and
+            reply.size() < MAX_PUT_LENGTH + 8,
+        "BAD_PUT for an oversize PUT", reply);
+
+  // The same in pieces, the rest of the line is skipped.
+  reply = client.exchange({"PUT 3 " + zeros, zeros, "1\r\n"});
+  check(reply.starts_with("BAD_PUT 3 000") and
+            reply.find("\r\n") == reply.size() - 2,
+        "one BAD_PUT for an oversize PUT in pieces", reply);
+  reply = client.exchange({"PUT 3 1\r\n"});
+  check(reply.starts_with("STATE 0.0000000 1.0000000 0.0000000 1.0000000 "),
+        "STATE for a PUT after an oversize one", reply);
+
+  // A bad PUT after the first line of a read gets PENALTY too, even with no
+  // reply queued.
+  reply = client.exchange({"XYZ\r\nPUT 99 1\r\n"});
+  check(reply == "PENALTY 99 1\r\nBAD_PUT 99 1\r\n",
+        "PENALTY and BAD_PUT for a bad PUT after another line", reply);
+
+  // In the lobby a PUT that was on its way when the game ended is dropped,
+  // it does not get PENALTY in the next game.
+  Server lobby(0, 10, true);
+  lobby.add_room(10, 1, 2, coeff_path);
+  if (lobby.set_up() < 0) {
+    return 1;
+  }
+  TestClient lobby_client(lobby);
+  if (lobby_client.connect() < 0) {
+    return 1;
+  }
+  lobby_client.exchange({"HELLO TEST\r\n"});
+  lobby_client.exchange({"PUT 1 1\r\n"});
+  reply = lobby_client.exchange({"PUT 1 1\r\n", "PUT 2 1\r\n"});
+  check(reply.starts_with("SCORING TEST ") and
+            reply.ends_with("COEFF 3 4\r\n") and
+            reply.find("PENALTY") == string::npos,
+        "SCORING and COEFF without PENALTY at the end of a lobby game",
+        reply);
+  reply = lobby_client.exchange({"PUT 1 1\r\n"});
+  check(reply.starts_with("STATE "), "STATE in the next lobby game", reply);
+
+  log_flush();
+  unlink(coeff_path);
+  if (failures == 0) {
+    cout << "All checks passed." << endl;
+  }
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,167 @@
+#include "checkpoint.hpp"
+
+#include <charconv>
+#include <cinttypes>
+#include <cstdio>
+#include <sstream>
+
+namespace {
+
+void append_double(string& out, double val) {
+  char buff[32];
+  auto res = to_chars(buff, buff + sizeof(buff), val);
+  out.append(buff, (size_t)(res.ptr - buff));
+}
+
+void append_values(string& out, const vector<double>& values) {
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (i > 0) {
+      out += ' ';
+    }
+    append_double(out, values[i]);
+  }
+  out += '\n';
+}
+
+// returns false iff the line does not contain exactly n doubles
+bool parse_values(const string& line, size_t n, vector<double>& values) {
+  values.resize(n);
+  const char* ptr = line.data();
+  const char* end = line.data() + line.size();
+  for (size_t i = 0; i < n; ++i) {
+    while (ptr < end and *ptr == ' ') {
+      ++ptr;
+    }
+    auto res = from_chars(ptr, end, values[i]);
+    if (res.ec != errc()) {
+      return false;
+    }
+    ptr = res.ptr;
+  }
+  return ptr == end;
+}
+
+}  // namespace
+
+int write_checkpoint(Server& server, const string& path) {
+  string out = "CHECKPOINT " + to_string(server.rooms.size()) + "\n";
+
+  for (size_t r = 0; r < server.rooms.size(); ++r) {
+    Room& room = server.rooms[r];
+    vector<size_t> in_room;
+    for (size_t i = FIRST_CLIENT; i < server.pollvec.size(); ++i) {
+      if (server.players[i].room == r and server.players[i].in_game()) {
+        in_room.push_back(i);
+      }
+    }
+    if (!room.playing) {
+      in_room.clear();
+    }
+    size_t n_saved = in_room.size() + room.detached.size();
+    int64_t position = room.file.tellg();
+    out += "ROOM " + to_string(room.k) + " " + to_string(room.m) + " " +
+           to_string(position) + " " + to_string(n_saved) + "\n";
+
+    auto append_player = [&](const string& id, int32_t n_proper_puts,
+                             double error, const vector<double>& approx,
+                             const vector<double>& goal, const string& coeff) {
+      out += "PLAYER " + id + " " + to_string(n_proper_puts) + " ";
+      append_double(out, error);
+      out += '\n';
+      append_values(out, approx);
+      append_values(out, goal);
+      out += coeff.substr(0, coeff.size() - 2) + "\n";
+    };
+    for (size_t i : in_room) {
+      const Player& p = server.players[i];
+      append_player(p.id, p.n_proper_puts, p.error, p.approx, p.goal,
+                    p.coeff_message);
+    }
+    // Players that did not reattach yet are kept for the next restart.
+    if (room.playing) {
+      for (const auto& p : room.detached) {
+        append_player(p.id, p.n_proper_puts, p.error, p.approx, p.goal,
+                      p.coeff);
+      }
+    }
+  }
+
+  string tmp_path = path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "w");
+  if (!file) {
+    return -1;
+  }
+  bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+  ok &= fflush(file) == 0 and fsync(fileno(file)) == 0;
+  ok &= fclose(file) == 0;
+  if (!ok or rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int read_checkpoint(Server& server, const string& path) {
+  ifstream file(path);
+  if (!file) {
+    return -1;
+  }
+  auto bad_checkpoint = [&](const string& why) {
+    print_error("bad checkpoint " + path + ": " + why + ".");
+    for (auto& room : server.rooms) {
+      room.detached.clear();
+    }
+    return -1;
+  };
+
+  string line, word;
+  size_t n_rooms = 0;
+  if (!getline(file, line) or
+      sscanf(line.c_str(), "CHECKPOINT %zu", &n_rooms) != 1) {
+    return bad_checkpoint("missing header");
+  }
+  if (n_rooms != server.rooms.size()) {
+    return bad_checkpoint("different number of rooms");
+  }
+
+  vector<int64_t> positions(n_rooms);
+  for (size_t r = 0; r < n_rooms; ++r) {
+    Room& room = server.rooms[r];
+    int32_t k, m;
+    size_t n_saved;
+    if (!getline(file, line) or
+        sscanf(line.c_str(), "ROOM %" SCNd32 " %" SCNd32 " %" SCNd64 " %zu",
+               &k, &m, &positions[r], &n_saved) != 4) {
+      return bad_checkpoint("bad room " + to_string(r));
+    }
+    if (k != room.k or m != room.m) {
+      return bad_checkpoint("different parameters of room " + to_string(r));
+    }
+    for (size_t i = 0; i < n_saved; ++i) {
+      PlayerSnapshot p;
+      string approx_line, goal_line;
+      if (!getline(file, line) or !getline(file, approx_line) or
+          !getline(file, goal_line) or !getline(file, p.coeff)) {
+        return bad_checkpoint("truncated player in room " + to_string(r));
+      }
+      istringstream words(line);
+      words >> word >> p.id >> p.n_proper_puts >> p.error;
+      size_t values = (size_t)k + 1;
+      if (!words or word != "PLAYER" or !is_id_valid(p.id) or
+          !parse_values(approx_line, values, p.approx) or
+          !parse_values(goal_line, values, p.goal)) {
+        return bad_checkpoint("bad player in room " + to_string(r));
+      }
+      p.coeff += "\r\n";
+      room.detached.push_back(p);
+    }
+  }
+
+  // Only now that the whole file is fine the coefficients cursors move.
+  for (size_t r = 0; r < n_rooms; ++r) {
+    server.rooms[r].file.seekg(positions[r]);
+    if (!server.rooms[r].file) {
+      return bad_checkpoint("bad position in " + server.rooms[r].filename);
+    }
+  }
+  return 0;
+}
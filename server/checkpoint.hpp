@@ -0,0 +1,24 @@
+#pragma once
+
+#include "utils-server.hpp"
+
+// Checkpoint file format (text, one record per line):
+//   CHECKPOINT <number of rooms>
+//   ROOM <k> <m> <coefficients file position> <number of players>
+// and for every player of a room that is playing (none between games):
+//   PLAYER <id> <n_proper_puts> <error>
+//   <approx values>
+//   <goal values>
+//   <COEFF message without "\r\n">
+// Doubles are written in the shortest form that reads back exactly.
+// A restored player is given back to whoever sends HELLO with its id first,
+// the id is not checked against the address it played from.
+
+// Writes the state of all rooms to path (through a temporary file, so the
+// previous checkpoint stays valid until the new one is complete).
+// returns -1 on error
+int write_checkpoint(Server& server, const string& path);
+
+// Restores coefficients file positions and detached players of all rooms.
+// returns -1 on error
+int read_checkpoint(Server& server, const string& path);
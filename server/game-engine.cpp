@@ -0,0 +1,103 @@
+#include "game-engine.hpp"
+
+#include <algorithm>
+
+#include "../common/trace.hpp"
+
+void GamePlayer::hello(const string& _id) {
+  id = _id;
+  n_small_letters = 0;
+  for (char c : id) {
+    if (c >= 'a' and c <= 'z') {
+      ++n_small_letters;
+    }
+  }
+}
+
+void GamePlayer::start(int32_t k) { approx.assign((size_t)k + 1, 0.0); }
+
+void GamePlayer::set_coefficients(const vector<double>& coeffs) {
+  size_t k = approx.size() - 1;
+  goal.assign(k + 1, 0.0);
+
+  for (size_t i = 0; i <= k; ++i) {
+    // Calculate the polynomial value at i
+    double power = 1.0;
+    double i_d = (double)i;
+    for (double coeff : coeffs) {
+      goal[i] += coeff * power;
+      power *= i_d;
+    }
+    error += goal[i] * goal[i];  // Sum of squares of the goal values
+  }
+}
+
+bool GamePlayer::in_game() const { return !goal.empty(); }
+
+bool GamePlayer::is_bad_put(int64_t point, double value) const {
+  if (point < 0 or point >= (int64_t)approx.size()) {
+    return true;
+  }
+  return value < -MAX_PUT_VALUE or value > MAX_PUT_VALUE;
+}
+
+PutResult GamePlayer::put(int64_t point, double value, bool early) {
+  TRACE_SCOPE("put");
+  PutResult result;
+  result.bad_put = is_bad_put(point, value);
+  if (early) {
+    // It was sent before the player received a reply, so it is not applied.
+    result.penalty = true;
+    error += PENALTY_POINTS;
+    return result;
+  }
+  if (result.bad_put) {
+    return result;
+  }
+
+  // we add (approx + value - goal)^2 and subtract (approx - goal)^2
+  // a^2 - b^2 = (a - b)(a + b)
+  size_t i = (size_t)point;
+  error += value * (value + 2 * (approx[i] - goal[i]));
+  approx[i] += value;
+  ++n_proper_puts;
+  result.state = true;
+  return result;
+}
+
+uint64_t GamePlayer::state_delay_s() const {
+  return STATE_DELAY_S_PER_SMALL_LETTER * n_small_letters;
+}
+
+void GamePlayer::reset_game() {
+  n_proper_puts = 0;
+  fill(approx.begin(), approx.end(), 0.0);
+  goal.clear();
+  error = 0.0;
+}
+
+vector<pair<string, double>> scores_by_id(
+    const vector<const GamePlayer*>& players) {
+  vector<pair<string, double>> scoring;
+  for (const GamePlayer* player : players) {
+    scoring.push_back({player->id, player->error});
+  }
+  auto comp = [](const auto& a, const auto& b) { return a.first < b.first; };
+  sort(scoring.begin(), scoring.end(), comp);
+  return scoring;
+}
+
+vector<size_t> rank_order(const vector<const GamePlayer*>& players) {
+  vector<size_t> order(players.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  auto comp = [&](size_t a, size_t b) {
+    if (players[a]->error != players[b]->error) {
+      return players[a]->error < players[b]->error;
+    }
+    return players[a]->id < players[b]->id;
+  };
+  sort(order.begin(), order.end(), comp);
+  return order;
+}
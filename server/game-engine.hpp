@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../common/rules.hpp"
+
+using namespace std;
+
+// Rules of the game without sockets, clocks or logging. The server wraps
+// them with I/O and approx-sim runs them in-process.
+
+// Replies the player gets for a PUT.
+struct PutResult {
+  bool penalty = false;  // PENALTY, the PUT was sent before the last reply
+  bool bad_put = false;  // BAD_PUT, point or value out of range
+  bool state = false;    // STATE, the PUT was applied
+};
+
+struct GamePlayer {
+  string id = "UNKNOWN";
+  size_t n_small_letters = 0;  // Number of small letters in the id
+  int32_t n_proper_puts = 0;
+
+  vector<double> approx;
+  vector<double> goal;
+  double error = 0.0;
+
+  // HELLO: sets the id, which also decides how long STATE is delayed.
+  void hello(const string& _id);
+  // Allocates the approximation of a game with parameter k.
+  void start(int32_t k);
+  // COEFF: sets the goal to the polynomial values at 0, 1, ..., k.
+  void set_coefficients(const vector<double>& coeffs);
+  bool in_game() const;
+
+  // point is -1 if it is not a proper integer.
+  bool is_bad_put(int64_t point, double value) const;
+  // early iff the PUT was sent before all replies to the player were sent.
+  PutResult put(int64_t point, double value, bool early);
+  uint64_t state_delay_s() const;
+
+  // Prepares the player for the next game with the same k.
+  void reset_game();
+};
+
+// Scores in SCORING order (by id).
+vector<pair<string, double>> scores_by_id(
+    const vector<const GamePlayer*>& players);
+// Indices of players from the best (lowest error, then id) to the worst.
+vector<size_t> rank_order(const vector<const GamePlayer*>& players);
@@ -0,0 +1,177 @@
+#include "journal.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "../common/utils.hpp"
+
+namespace {
+
+constexpr char MAGIC[] = "APXJ";
+constexpr uint8_t VERSION = 1;
+constexpr size_t FLUSH_BYTES = 1 << 16;
+constexpr auto FLUSH_PERIOD = milliseconds(100);
+constexpr uint64_t MAX_LENGTH = 1 << 24;  // Longer ones are corruption
+
+void append_varint(string& out, uint64_t value) {
+  while (value >= 0x80) {
+    out += (char)(uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out += (char)(uint8_t)value;
+}
+
+}  // namespace
+
+// JournalWriter
+
+JournalWriter::~JournalWriter() {
+  if (fd >= 0) {
+    flush(true);
+    ::close(fd);
+  }
+}
+
+int JournalWriter::open(const string& path) {
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0) {
+    print_error("cannot open journal " + path + ": " + strerror(errno));
+    return -1;
+  }
+  buffer.append(MAGIC, sizeof(MAGIC) - 1);
+  buffer += (char)VERSION;
+  last_record = last_flush = steady_clock::now();
+  return 0;
+}
+
+void JournalWriter::begin_record(JournalType type, uint64_t connection) {
+  auto now = steady_clock::now();
+  buffer += (char)type;
+  append_varint(buffer, connection);
+  append_varint(buffer,
+                (uint64_t)duration_cast<nanoseconds>(now - last_record)
+                    .count());
+  last_record = now;
+}
+
+void JournalWriter::connect(uint64_t connection, const string& ip,
+                            uint16_t port) {
+  begin_record(JournalType::CONNECT, connection);
+  append_varint(buffer, port);
+  append_varint(buffer, ip.size());
+  buffer += ip;
+}
+
+void JournalWriter::data(uint64_t connection, const char* bytes, size_t len) {
+  begin_record(JournalType::DATA, connection);
+  append_varint(buffer, len);
+  buffer.append(bytes, len);
+}
+
+void JournalWriter::close(uint64_t connection) {
+  begin_record(JournalType::CLOSE, connection);
+}
+
+void JournalWriter::flush(bool force) {
+  if (fd < 0 or buffer.empty()) {
+    return;
+  }
+  auto now = steady_clock::now();
+  if (!force and buffer.size() < FLUSH_BYTES and
+      now - last_flush < FLUSH_PERIOD) {
+    return;
+  }
+  last_flush = now;
+  size_t written = 0;
+  while (written < buffer.size()) {
+    ssize_t res = write(fd, buffer.data() + written, buffer.size() - written);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // I keep serving the game, the journal just ends here.
+      print_error("cannot write journal, disabling it: " +
+                  string(strerror(errno)));
+      ::close(fd);
+      fd = -1;
+      break;
+    }
+    written += (size_t)res;
+  }
+  buffer.clear();
+}
+
+// JournalReader
+
+int JournalReader::open(const string& path) {
+  file.open(path, ios::binary);
+  if (!file) {
+    print_error("cannot open journal " + path + ".");
+    return -1;
+  }
+  char header[sizeof(MAGIC)];
+  if (!file.read(header, sizeof(header)) or
+      memcmp(header, MAGIC, sizeof(MAGIC) - 1) != 0 or
+      (uint8_t)header[sizeof(MAGIC) - 1] != VERSION) {
+    print_error(path + " is not a journal of this version.");
+    return -1;
+  }
+  return 0;
+}
+
+bool JournalReader::read_varint(uint64_t& value) {
+  value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    int byte = file.get();
+    if (byte == EOF) {
+      return false;
+    }
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int JournalReader::next(JournalEntry& entry) {
+  int type = file.get();
+  if (type == EOF) {
+    return 0;
+  }
+  uint64_t delta, port, len;
+  if (type < (int)JournalType::CONNECT or type > (int)JournalType::CLOSE or
+      !read_varint(entry.connection) or !read_varint(delta)) {
+    print_error("journal is corrupted.");
+    return -1;
+  }
+  entry.type = (JournalType)type;
+  at += nanoseconds(delta);
+  entry.at = at;
+  entry.ip.clear();
+  entry.data.clear();
+  if (entry.type == JournalType::CONNECT) {
+    if (!read_varint(port) or !read_varint(len) or len > MAX_LENGTH) {
+      print_error("journal is corrupted.");
+      return -1;
+    }
+    entry.port = (uint16_t)port;
+    entry.ip.resize(len);
+    file.read(entry.ip.data(), (streamsize)len);
+  } else if (entry.type == JournalType::DATA) {
+    if (!read_varint(len) or len > MAX_LENGTH) {
+      print_error("journal is corrupted.");
+      return -1;
+    }
+    entry.data.resize(len);
+    file.read(entry.data.data(), (streamsize)len);
+  }
+  if (!file) {
+    print_error("journal ends in the middle of a record.");
+    return -1;
+  }
+  return 1;
+}
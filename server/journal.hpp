@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+using namespace std;
+using namespace std::chrono;
+
+// Journal of everything clients send (approx-server -j), so approx-replay can
+// feed the same bytes in the same chunks to the server logic again.
+// After the header "APXJ" <version byte> every record is
+//   <type byte> <connection> <nanoseconds since the previous record>
+// followed for CONNECT by <port> <ip length> <ip> and for DATA by
+// <length> <bytes>, one DATA record per read. Numbers are LEB128 varints.
+// CLOSE means the client closed the connection (or it failed).
+
+enum class JournalType : uint8_t { CONNECT = 1, DATA = 2, CLOSE = 3 };
+
+struct JournalEntry {
+  JournalType type;
+  uint64_t connection;
+  nanoseconds at;  // Since the first record
+  string ip;       // CONNECT
+  uint16_t port = 0;
+  string data;  // DATA
+};
+
+// Appends records to a buffer, which is written out when it is big or old
+// enough, so the event loop does not pay a write per read.
+class JournalWriter {
+  int fd = -1;
+  string buffer;
+  steady_clock::time_point last_record;
+  steady_clock::time_point last_flush;
+
+  void begin_record(JournalType type, uint64_t connection);
+
+ public:
+  ~JournalWriter();
+
+  // Creates or truncates the journal at path.
+  // returns -1 on error
+  int open(const string& path);
+  bool enabled() const { return fd >= 0; }
+
+  void connect(uint64_t connection, const string& ip, uint16_t port);
+  void data(uint64_t connection, const char* bytes, size_t len);
+  void close(uint64_t connection);
+  // Writes the buffer if it is 64 KiB or 100 ms old (always if force).
+  void flush(bool force = false);
+};
+
+class JournalReader {
+  ifstream file;
+  nanoseconds at{0};
+
+  // returns false at the end of the file
+  bool read_varint(uint64_t& value);
+
+ public:
+  // returns -1 on error
+  int open(const string& path);
+  // returns -1 on error, 0 at the end of the journal, 1 otherwise
+  int next(JournalEntry& entry);
+};
@@ -1,8 +1,35 @@
 #include "utils-server.hpp"
 
+#include <sys/stat.h>
+#include <sys/wait.h>
+
 #include <algorithm>
 #include <charconv>
 
+#include "checkpoint.hpp"
+
+volatile sig_atomic_t metrics_dump_requested = 0;
+volatile sig_atomic_t stop_requested = 0;
+
+ServerMetrics &server_metrics() {
+  static ServerMetrics instance;
+  return instance;
+}
+
+void GameClock::set_mode(ClockMode _mode) {
+  mode = _mode;
+  virtual_now = steady_clock::now();
+}
+void GameClock::advance(TimePoint t) {
+  if (mode != ClockMode::REAL) {
+    virtual_now = max(virtual_now, t);
+  }
+}
+GameClock &game_clock() {
+  static GameClock instance;
+  return instance;
+}
+
 // Make socket functions
 
 int ipv6_enabled_sock(uint16_t port) {
@@ -84,8 +111,43 @@ int ipv4_only_sock(uint16_t port) {
   return socket_fd;
 }
 
+int unix_sock(const string &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    print_error("socket path is too long: " + path);
+    return -1;
+  }
+  path.copy(addr.sun_path, path.size());
+
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      print_error(path + " exists and is not a socket.");
+      errno = EEXIST;
+      return -1;
+    }
+    unlink(path.c_str());  // A socket left by a previous run.
+  }
+
+  int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket_fd < 0) {
+    return -1;
+  }
+  if (bind(socket_fd, (sockaddr *)&addr, sizeof(addr)) < 0 or
+      listen(socket_fd, SOMAXCONN) < 0) {
+    close(socket_fd);
+    return -1;
+  }
+  return socket_fd;
+}
+
 // Message functions
 
+bool is_oversize_put(const string &msg) {
+  return msg.starts_with("PUT ") and !msg.ends_with("\r\n");
+}
+
 bool proper_hello(const string &msg) {
   bool pref_suf = msg.size() > 8 and msg.substr(0, 6) == "HELLO " and
                   msg.substr(msg.size() - 2, 2) == "\r\n";
@@ -95,22 +157,48 @@ bool proper_hello(const string &msg) {
   }
 
   string id = id_from_hello(msg);
-
-  return is_id_valid(id);
+  if (id.empty() or !is_id_valid(id)) {
+    return false;
+  }
+  for (const string &option : hello_options(msg)) {
+    size_t prefix_len = strlen(ROOM_OPTION);
+    bool is_room = option.size() > prefix_len and
+                   option.compare(0, prefix_len, ROOM_OPTION) == 0;
+    if (is_room and get_int(option.substr(prefix_len), INT32_MAX) < 0) {
+      return false;  // Room must be a number
+    }
+    if (option != COMPACT_OPTION and !is_room) {
+      return false;  // Unknown option
+    }
+  }
+  return true;
 }
 
 string id_from_hello(const string &msg) {
-  return msg.substr(6, msg.size() - 8);  // Remove "HELLO " and "\r\n"
+  // Remove "HELLO " and "\r\n", the id ends at the first space.
+  size_t id_end = min(msg.find(' ', 6), msg.size() - 2);
+  return msg.substr(6, id_end - 6);
 }
 
-size_t get_no_small_letters(const string &str) {
-  size_t count = 0;
-  for (char c : str) {
-    if (c >= 'a' and c <= 'z') {
-      ++count;
+int64_t room_from_hello(const string &msg) {
+  size_t prefix_len = strlen(ROOM_OPTION);
+  for (const string &option : hello_options(msg)) {
+    if (option.compare(0, prefix_len, ROOM_OPTION) == 0) {
+      return get_int(option.substr(prefix_len), INT32_MAX);
     }
   }
-  return count;
+  return -1;
+}
+
+vector<string> hello_options(const string &msg) {
+  vector<string> options;
+  size_t end = msg.size() - 2;  // Without "\r\n"
+  for (size_t i = msg.find(' ', 6); i < end;) {
+    size_t next_space = min(msg.find(' ', i + 1), end);
+    options.push_back(msg.substr(i + 1, next_space - i - 1));
+    i = next_space;
+  }
+  return options;
 }
 
 string make_penalty(const string &point, const string &value) {
@@ -128,7 +216,18 @@ string make_coeff(ifstream &file) {
   res += '\n';  // getline pops \n char
   return res;
 }
+string make_compact_scoring(size_t rank, double error,
+                            const vector<pair<string, double>> &top) {
+  string res = "SCORING_TOP " + to_string(rank) + " " + to_string(error);
+  for (const auto &i : top) {
+    res += " " + i.first + " " + to_string(i.second);
+  }
+  res += "\r\n";
+  return res;
+}
 string make_state(const vector<double> &approx) {
+  TRACE_SCOPE("make_state");
+  ALLOC_SCOPE(AllocTag::STATE);
   string res = "STATE";
   for (double val : approx) {
     res += " " + to_proper_rational(val);
@@ -159,6 +258,14 @@ tuple<string, string> get_point_and_value(const string &msg) {
   return {point, value};
 }
 
+tuple<string, string> get_oversize_point_and_value(const string &msg) {
+  size_t sep = msg.find(' ', 4);
+  if (sep == string::npos) {
+    return {msg.substr(4), ""};
+  }
+  return {msg.substr(4, sep - 4), msg.substr(sep + 1)};
+}
+
 bool is_put(const string &msg) {
   bool pref_suf = msg.size() > 8 and msg.substr(0, 4) == "PUT " and
                   msg.substr(msg.size() - 2, 2) == "\r\n";
@@ -185,28 +292,69 @@ bool is_put(const string &msg) {
   return true;
 }
 
-// This function assumes that the message is a PUT message checked by is_put.
-bool is_bad_put(const string &point, const string &value, int32_t k) {
-  int64_t point_int = get_int(point, (int64_t)k);
-  if (point_int < 0) {
-    return true;
-  }
-  double value_double = get_double(value);
-  if (value_double < -5 or value_double > 5) {
-    return true;
-  }
-  return false;
-}
-
 // MessageQueue
 
 void MessageQueue::push(const string &msg, uint64_t delay_s) {
-  auto now = steady_clock::now();
+  ALLOC_SCOPE(AllocTag::QUEUE);
+  if (overflowed) {
+    return;  // The client is disconnected after this read anyway.
+  }
+  if (exceeds_limits(msg.size())) {
+    if (limits->policy == OutputPolicy::COALESCE and
+        msg.starts_with("STATE ")) {
+      // Every STATE has the whole approximation, the newest is enough.
+      server_metrics().coalesced_states.add(drop_states());
+    }
+    if (exceeds_limits(msg.size())) {
+      overflowed = true;
+      return;
+    }
+  }
+  auto now = game_clock().now();
   auto time_to_send = now + seconds(delay_s);
-  messages.push({time_to_send, msg});
+  messages.push({time_to_send, now, pushed++, msg});
+  queued_bytes += msg.size();
+}
+void MessageQueue::clear_waiting() {
+  messages = {};
+  queued_bytes = current_message.size() - current_pos;
+}
+bool MessageQueue::exceeds_limits(size_t msg_size) const {
+  if (limits == NULL) {
+    return false;
+  }
+  return (limits->max_bytes > 0 and
+          queued_bytes + msg_size > limits->max_bytes) or
+         (limits->max_messages > 0 and
+          messages.size() + 1 > limits->max_messages);
+}
+size_t MessageQueue::drop_states() {
+  vector<Msg> kept;
+  kept.reserve(messages.size());
+  size_t dropped = 0;
+  while (!messages.empty()) {
+    // top() is const, but the message is popped right away.
+    Msg &top = const_cast<Msg &>(messages.top());
+    if (top.text.starts_with("STATE ")) {
+      queued_bytes -= top.text.size();
+      ++dropped;
+    } else {
+      kept.push_back(std::move(top));
+    }
+    messages.pop();
+  }
+  for (Msg &msg : kept) {
+    messages.push(std::move(msg));
+  }
+  return dropped;
 }
 void MessageQueue::get_current() {
-  current_message = messages.top().second;
+  ALLOC_SCOPE(AllocTag::QUEUE);
+  const Msg &top = messages.top();
+  server_metrics().send_lateness_us.record(
+      micros_since(top.ready, game_clock().now()));
+  current_message = top.text;
+  current_queued = top.queued;
   current_pos = 0;
   messages.pop();
 }
@@ -223,8 +371,8 @@ bool MessageQueue::ready_message() const {
   if (messages.empty()) {
     return false;
   }
-  auto now = steady_clock::now();
-  return messages.top().first <= now;
+  auto now = game_clock().now();
+  return messages.top().ready <= now;
 }
 // Returns: -1 iff error, 1 iff the whole message was sent, 0 otherwise
 int MessageQueue::send_message(int socket_fd) {
@@ -236,12 +384,19 @@ int MessageQueue::send_message(int socket_fd) {
                            current_message.size() - current_pos);
 
   if (sent_len < 0) {
+    if (errno == EAGAIN or errno == EWOULDBLOCK) {
+      return 0;  // Written without POLLOUT, the socket buffer is full.
+    }
     print_error("Cannot send message to client. errno: " + to_string(errno));
     return -1;
   }
   current_pos += (size_t)sent_len;
+  queued_bytes -= (size_t)sent_len;
+  server_metrics().bytes_out.add((uint64_t)sent_len);
   if (current_pos == current_message.size()) {
     // We have sent the whole message.
+    server_metrics().reply_latency_us.record(
+        micros_since(current_queued, game_clock().now()));
     current_pos = 0;
     current_message = "";
     return 1;
@@ -250,18 +405,21 @@ int MessageQueue::send_message(int socket_fd) {
 }
 TimePoint MessageQueue::get_ready_time() const {
   if (!current_message.empty()) {
-    return steady_clock::now();  // If we are currently sending a message,
+    return game_clock().now();  // If we are currently sending a message,
                                  // return now.
   } else if (!messages.empty()) {
-    return messages.top().first;
+    return messages.top().ready;
   } else {
-    return steady_clock::now() +
+    return game_clock().now() +
            seconds(10);  // so as not to give to large value
   }
 }
 void MessageQueue::send_scoring(const string &scoring, int socket_fd) {
+  ALLOC_SCOPE(AllocTag::QUEUE);
+  queued_bytes += scoring.size();
   if (current_message.empty()) {
     current_message = scoring;
+    current_queued = game_clock().now();
     current_pos = 0;
   } else {
     current_message += scoring;
@@ -272,7 +430,21 @@ void MessageQueue::send_scoring(const string &scoring, int socket_fd) {
 // Player
 
 int Player::set_port_and_ip() {
-  if (addr.ss_family == AF_INET) {  // ipv4
+  if (addr.ss_family == AF_UNIX) {
+    // Clients of the AF_UNIX socket have no address, the peer's pid tells
+    // them apart (and is what the per-IP limit counts, so all sessions of
+    // one approx-client -c process share one limit).
+    ucred cred{};
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+      print_error("cannot get peer of a local client. errno: " +
+                  to_string(errno));
+      return -1;
+    }
+    ip = "unix:" + to_string(cred.pid);
+    port = 0;
+    return 0;
+  } else if (addr.ss_family == AF_INET) {  // ipv4
     const sockaddr_in *addr4 = (sockaddr_in *)(&addr);
     const in_addr *ia = (in_addr *)(&addr4->sin_addr);
     char buff[INET_ADDRSTRLEN] = {0};
@@ -299,26 +471,101 @@ int Player::set_port_and_ip() {
   }
 }
 
-int Player::read_message(const string &msg, ifstream &file) {
-  int32_t k = (int32_t)approx.size() - 1;
+size_t Player::max_line_length() const {
+  return helloed ? MAX_PUT_LENGTH : MAX_HELLO_LENGTH;
+}
 
+void Player::keep_oversize_put(size_t start, size_t max_length,
+                               vector<string> &messages) const {
+  string_view line(buffered_message);
+  line = line.substr(start, max_length);
+  if (line.starts_with("PUT ")) {
+    while (line.ends_with('\r')) {
+      line.remove_suffix(1);
+    }
+    messages.emplace_back(line);
+  }
+}
+
+int Player::read_message(string_view msg, vector<Room> &rooms) {
+  TRACE_SCOPE("read_message");
+  ALLOC_SCOPE(AllocTag::FRAMING);
   int res = 0;
-  size_t old_len = buffered_message.size();
+  if (stale_input and in_game() and messages_to_send.empty()) {
+    // The new COEFF is sent, so everything read before it is stale.
+    stale_input = false;
+    buffered_message.clear();
+    discarding = pending_lines = false;
+  }
+  if (discarding) {
+    size_t skip;
+    if (!buffered_message.empty() and msg.starts_with('\n')) {
+      skip = 1;  // "\r" ended the previous read
+    } else if ((skip = msg.find("\r\n")) != string_view::npos) {
+      skip += 2;
+    } else {
+      buffered_message = msg.ends_with('\r') ? "\r" : "";
+      return 0;
+    }
+    msg.remove_prefix(skip);
+    buffered_message.clear();
+    discarding = false;
+    if (msg.empty()) {
+      return 0;  // Nothing of the next line yet
+    }
+  }
+
+  // Lines left over by the budget are complete, so I look at them again.
+  size_t old_len = pending_lines ? 0 : buffered_message.size();
   buffered_message += msg;
   size_t erase_pref = 0;
   vector<string> messages;
+  size_t max_length = max_line_length();
+  pending_lines = false;
 
   // every message ends with "\r\n"
-  for (size_t i = old_len > 0 ? old_len - 1 : 0;
-       i + 1 < buffered_message.size(); ++i) {
-    if (buffered_message[i] == '\r' and buffered_message[i + 1] == '\n') {
-      // Found end of a message.
+  for (size_t i = buffered_message.find("\r\n", old_len > 0 ? old_len - 1 : 0);
+       i != string::npos; i = buffered_message.find("\r\n", i + 2)) {
+    if (messages.size() == MESSAGE_BUDGET) {
+      // The rest waits for the next iteration, after the other clients.
+      pending_lines = true;
+      break;
+    }
+    // Found end of a message.
+    if (i + 2 - erase_pref > max_length) {
+      server_metrics().oversize_lines.add();
+      print_error("too long line (" + to_string(i + 2 - erase_pref) +
+                  " bytes) from " + to_string_w_id() + ".");
+      if (!helloed) {
+        return -1;
+      }
+      keep_oversize_put(erase_pref, max_length, messages);
+    } else {
       messages.push_back(
           buffered_message.substr(erase_pref, i + 2 - erase_pref));
-      erase_pref = i + 2;  // Erase everything before this point.
     }
+    erase_pref = i + 2;  // Erase everything before this point.
   }
   buffered_message.erase(0, erase_pref);
+  if (!pending_lines and buffered_message.size() > max_length) {
+    // No legal message is that long, I don't keep it to see how it ends.
+    server_metrics().oversize_lines.add();
+    print_error("too long line (over " + to_string(max_length) +
+                " bytes) from " + to_string_w_id() + ".");
+    if (!helloed) {
+      return -1;
+    }
+    keep_oversize_put(0, max_length, messages);
+    discarding = true;
+    buffered_message = buffered_message.ends_with('\r') ? "\r" : "";
+  }
+  if (stale_input) {
+    if (!messages.empty()) {
+      log_info("Dropped " + to_string(messages.size()) + " lines from " +
+               to_string_w_id() + ", sent before the next game.");
+    }
+    return 0;
+  }
 
   if (messages.empty()) {
     started_before_reply = true;
@@ -343,94 +590,58 @@ int Player::read_message(const string &msg, ifstream &file) {
       return -1;
     } else {
       // First message is a proper HELLO.
+      ALLOC_SCOPE(AllocTag::PARSING);
       id = id_from_hello(first_message);
-      n_small_letters = get_no_small_letters(id);
+      for (const string &option : hello_options(first_message)) {
+        compact_scoring |= option == COMPACT_OPTION;
+      }
+      bool reattached = reattach(rooms);
+      int64_t requested_room = room_from_hello(first_message);
+      if (!reattached and join_room(requested_room, rooms) < 0) {
+        print_error_bad_message(first_message);
+        return -1;
+      }
+      hello(id);
       helloed = true;
 
-      cout << to_string_wo_id() << " is now known as " << id << "." << endl;
-
-      string coeff = make_coeff(file);
-      string printed_coeff = coeff.substr(6, coeff.size() - 8);
+      log_info(to_string_wo_id() + " is now known as " + id + ".");
 
-      cout << "Player " << id << " get coefficients: " << printed_coeff << "."
-           << endl;
-
-      calc_goal_from_coef(coeff);
-      messages_to_send.push(coeff, 0);
+      if (reattached) {
+        log_info("Player " + id + " reattached with " +
+                 to_string(n_proper_puts) + " puts.");
+        messages_to_send.push(coeff_message, 0);
+      } else if (rooms[room].playing) {
+        send_coeff(rooms[room].file);
+      }  // Otherwise coefficients are sent when the next game starts.
     }
-  } else if (!is_put(first_message)) {
+  } else if (!in_game()) {
+    // The room is between games, there is nothing to PUT into yet.
+    print_error_bad_message(first_message);
+    started_before_reply = false;  // Reset the flag.
+  } else if (!is_put(first_message) and !is_oversize_put(first_message)) {
     // This is not even a proper PUT message.
     // I just print ERROR and ignore it.
     print_error_bad_message(first_message);
     started_before_reply = false;  // Reset the flag.
-  } else if (started_before_reply) {
-    // First message started before we got a reply.
-
-    // First message is a PUT message.
-    // It was sent before the player received a reply so I resend penalty.
-    auto [point, value] = get_point_and_value(first_message);
-    messages_to_send.push(make_penalty(point, value), 0);
-    error += 20.0;
-    // If the message is a bad put then we also send bad_put.
-    if (is_bad_put(point, value, k)) {
-      print_error_bad_message(msg);
-      messages_to_send.push(make_bad_put(point, value), 1);
-    }
-    started_before_reply = false;  // Reset the flag.
   } else {
-    // First message is a PUT message.
-    // If the message is a bad put then we also send bad_put.
-    auto [point, value] = get_point_and_value(first_message);
-    if (is_bad_put(point, value, k)) {
-      print_error_bad_message(msg);
-      messages_to_send.push(make_bad_put(point, value), 1);
-    } else {
-      // Update the approximation.
-      ++n_proper_puts;
-      update_approximation(point, value);
-
-      string state = make_state(approx);
-      string print_state =
-          state.substr(6, state.size() - 8);  // Remove "STATE " and "\r\n"
-      cout << "Sending state " << print_state << " to player " << id << "."
-           << endl;
-
-      messages_to_send.push(state, n_small_letters);
-      res = 1;
-    }
+    // First message is a PUT message. If it started before we sent a reply
+    // it gets a penalty.
+    res = handle_put(first_message, started_before_reply);
+    started_before_reply = false;  // Reset the flag.
   }
 
   for (size_t i = 1; i < messages.size(); ++i) {
     const string &msg_i = messages[i];
-    if (!is_put(msg_i)) {
+    if (!in_game() or (!is_put(msg_i) and !is_oversize_put(msg_i))) {
       // This is not even a proper PUT message.
       // I just print ERROR and ignore it.
       print_error_bad_message(msg_i);
       continue;  // Ignore this message.
     }
-    auto [point, value] = get_point_and_value(msg_i);
-    if (is_bad_put(point, value, k)) {
-      print_error_bad_message(msg_i);
-      messages_to_send.push(make_bad_put(point, value), 1);
-    }
-    if (messages_to_send.empty()) {
-      // If the message is a bad put then we also send bad_put.
-      ++n_proper_puts;
-      // Update the approximation.
-      update_approximation(point, value);
-
-      string state = make_state(approx);
-      string print_state =
-          state.substr(6, state.size() - 8);  // Remove "STATE " and "\r\n"
-      cout << "Sending state " << print_state << " to player " << id << "."
-           << endl;
-
-      messages_to_send.push(state, n_small_letters);
+    // If we have not sent all replies yet it is too early. A bad PUT queues
+    // its BAD_PUT before that is checked, so it is always early here.
+    if (handle_put(msg_i, !messages_to_send.empty(), true) == 1) {
       res = 1;
-    } else {
-      // We have already sent a reply.
-      messages_to_send.push(make_penalty(point, value), 0);
-      error += 20.0;
     }
   }
   if (!buffered_message.empty() and !messages_to_send.empty()) {
@@ -440,11 +651,116 @@ int Player::read_message(const string &msg, ifstream &file) {
   return res;
 }
 
+void Player::send_coeff(ifstream &file) {
+  string coeff = make_coeff(file);
+  string printed_coeff = coeff.substr(6, coeff.size() - 8);
+
+  log_info("Player " + id + " get coefficients: " + printed_coeff + ".");
+
+  set_coefficients(parse_coefficients(coeff));
+  messages_to_send.push(coeff, COEFF_DELAY_S);
+  coeff_message = coeff;
+}
+
+void Player::reset_game() {
+  // Replies from the previous game are dropped, but a partially sent message
+  // (e.g. the scoring) has to be finished.
+  messages_to_send.clear_waiting();
+  started_before_reply = false;
+  stale_input = true;
+  GamePlayer::reset_game();
+}
+
+int Player::handle_put(const string &msg, bool early, bool bad_is_early) {
+  TRACE_SCOPE("handle_put");
+  ALLOC_SCOPE(AllocTag::PARSING);
+  bool oversize = is_oversize_put(msg);
+  auto [point, value] = oversize ? get_oversize_point_and_value(msg)
+                                 : get_point_and_value(msg);
+  int64_t point_int =
+      oversize ? -1 : get_int(point, (int64_t)approx.size() - 1);
+  double value_double = oversize ? 0 : get_double(value);
+  early |= bad_is_early and is_bad_put(point_int, value_double);
+  PutResult result = put(point_int, value_double, early);
+  server_metrics().puts.add();
+  server_metrics().penalties.add(result.penalty);
+  server_metrics().bad_puts.add(result.bad_put);
+
+  if (result.penalty) {
+    messages_to_send.push(make_penalty(point, value), PENALTY_DELAY_S);
+  }
+  if (result.bad_put) {
+    if (!oversize) {  // It was reported as too long
+      print_error_bad_message(msg);
+    }
+    messages_to_send.push(make_bad_put(point, value), BAD_PUT_DELAY_S);
+  }
+  if (!result.state) {
+    return 0;
+  }
+  string state = make_state(approx);
+  string_view print_state = state;
+  print_state = print_state.substr(6, state.size() - 8);  // Remove "STATE "
+                                                          // and "\r\n"
+  log_values(LogCategory::STATE, "Sending state ", print_state,
+             " to player " + id + ".");
+
+  messages_to_send.push(state, state_delay_s());
+  return 1;
+}
+
+int Player::join_room(int64_t requested, vector<Room> &rooms) {
+  if (requested >= (int64_t)rooms.size()) {
+    return -1;
+  }
+  if (requested >= 0) {
+    room = (size_t)requested;
+  } else {
+    room = 0;
+    for (size_t r = 1; r < rooms.size(); ++r) {
+      if (rooms[r].n_players < rooms[room].n_players) {
+        room = r;
+      }
+    }
+  }
+  ++rooms[room].n_players;
+  start(rooms[room].k);
+  return 0;
+}
+
+bool Player::reattach(vector<Room> &rooms) {
+  for (size_t r = 0; r < rooms.size(); ++r) {
+    auto &detached = rooms[r].detached;
+    for (size_t i = 0; i < detached.size(); ++i) {
+      if (detached[i].id != id) {
+        continue;
+      }
+      PlayerSnapshot &snapshot = detached[i];
+      room = r;
+      ++rooms[r].n_players;
+      rooms[r].counter_m += snapshot.n_proper_puts;
+      n_proper_puts = snapshot.n_proper_puts;
+      error = snapshot.error;
+      approx = std::move(snapshot.approx);
+      goal = std::move(snapshot.goal);
+      coeff_message = std::move(snapshot.coeff);
+
+      swap(detached[i], detached.back());
+      detached.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
 bool Player::has_ready_message_to_send() const {
   return messages_to_send.ready_message();
 }
 // Returns: -1 iff error, 1 iff the whole message was sent, 0 otherwise
-int Player::send_message() { return messages_to_send.send_message(fd); }
+int Player::send_message() {
+  TRACE_SCOPE("send_message");
+  return messages_to_send.send_message(fd);
+}
 string Player::to_string_w_id() {  // with id
   return "[" + ip + "]:" + to_string(port) + ", " + id;
 }
@@ -458,36 +774,6 @@ void Player::send_scoring(const string &scoring) {
   messages_to_send.send_scoring(scoring, fd);
 }
 
-void Player::calc_goal_from_coef(string &coeff) {
-  size_t k = approx.size() - 1;
-  goal.resize(k + 1);
-  vector<double> coeffs = parse_coefficients(coeff);
-  size_t n = coeffs.size();
-
-  for (size_t i = 0; i <= k; ++i) {
-    // Calculate the polynomial value at i
-    double power = 1.0;
-    double i_d = (double)i;
-    for (size_t j = 0; j <= n; ++j) {
-      goal[i] += coeffs[j] * power;
-      power *= i_d;
-    }
-    error += goal[i] * goal[i];  // Sum of squares of the goal values
-  }
-}
-
-void Player::update_approximation(const string &point, const string &value) {
-  size_t k = approx.size() - 1;
-  size_t point_int = (size_t)get_int(point, (int64_t)k);
-  double value_double = get_double(value);
-
-  // we add (approx + value_double - goal)^2 and subtract (approx - goal)^2
-  // a^2 - b^2 = (a - b)(a + b)
-  error +=
-      value_double * (value_double + 2 * (approx[point_int] - goal[point_int]));
-  approx[point_int] += value_double;
-}
-
 // PlayerSet
 
 void PlayerSet::delete_client(size_t i) {
@@ -495,7 +781,9 @@ void PlayerSet::delete_client(size_t i) {
   players.pop_back();
 }
 Player &PlayerSet::operator[](size_t i) { return players[i]; }
-void PlayerSet::add_player(const Player &client) { players.push_back(client); }
+void PlayerSet::add_player(Player &&client) {
+  players.push_back(std::move(client));
+}
 
 // Pollvec
 
@@ -508,16 +796,40 @@ int Pollvec::set_up() {
     print_error("cannot create listening socket.");
     return -1;
   }
-  if (fcntl(socket_fd, F_SETFL, O_NONBLOCK)) {
+  int unix_fd = -1;
+  if (!unix_path.empty() and (unix_fd = unix_sock(unix_path)) < 0) {
+    close(socket_fd);
+    print_error("cannot listen on " + unix_path + ". errno: " +
+                to_string(errno));
+    return -1;
+  }
+  for (int fd : {socket_fd, unix_fd}) {
+    if (fd >= 0 and fcntl(fd, F_SETFL, O_NONBLOCK)) {
+      close(socket_fd);
+      if (unix_fd >= 0) {
+        close(unix_fd);
+      }
+      print_error("cannot set listening socket to non-blocking mode.");
+      return -1;
+    }
+  }
+  int timer_fd = -1;
+  if (deadline_timer and
+      (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+    print_error("cannot create deadline timer. errno: " + to_string(errno));
     close(socket_fd);
-    print_error("cannot set listening socket to non-blocking mode.");
+    if (unix_fd >= 0) {
+      close(unix_fd);
+    }
     return -1;
   }
-  pollfd listen_fd{};
-  listen_fd.fd = socket_fd;
-  listen_fd.events = POLLIN;
-  listen_fd.revents = 0;
-  pollfds.push_back(listen_fd);
+  for (int fd : {socket_fd, unix_fd, timer_fd}) {
+    pollfd listen_fd{};
+    listen_fd.fd = fd;
+    listen_fd.events = POLLIN;
+    listen_fd.revents = 0;
+    pollfds.push_back(listen_fd);
+  }
 
   return 0;
 }
@@ -532,49 +844,167 @@ size_t Pollvec::size() { return pollfds.size(); }
 
 // Server
 
+void Server::add_room(int32_t k, int32_t n, int32_t m, const string &filename) {
+  rooms.emplace_back(k, n, m, filename);
+}
+
 // returns 0 on success, -1 on fatal error
 int Server::set_up() {
   if (pollvec.set_up()) {
     // polvec prints error
     return -1;
   }
-  file.open(filename);
-  if (!file) {
-    print_error("cannot open file: " + string(filename));
-    return -1;
+  for (auto &room : rooms) {
+    room.file.open(room.filename);
+    if (!room.file) {
+      print_error("cannot open file: " + room.filename);
+      return -1;
+    }
+    room.next_game = game_clock().now();
+  }
+  if (!checkpoint_path.empty()) {
+    if (access(checkpoint_path.c_str(), F_OK) == 0 and
+        read_checkpoint(*this, checkpoint_path) == 0) {
+      log_info("Resumed from checkpoint " + checkpoint_path + ".");
+    }
+    next_checkpoint = game_clock().now() + checkpoint_interval;
   }
   return 0;
 }
 
-void Server::accept_new_connection() {
-  auto &listen_pollfd = pollvec[0];
+void Server::accept_new_connection(size_t listener) {
+  auto &listen_pollfd = pollvec[listener];
   if ((listen_pollfd.revents & POLLIN) == 0) {
     return;
   }
+  TRACE_SCOPE("accept");
 
   listen_pollfd.revents = 0;  // Reset revents for the next poll.
+  // Adding clients moves pollvec, so I keep just the descriptor.
+  int listen_fd = listen_pollfd.fd;
+
+  // During a flood I take a few connections per poll, enough to drain the
+  // backlog of the ones I close, while the players still get their turn.
+  for (int accepted = 0; accepted < ACCEPT_BATCH; ++accepted) {
+    Player client;
+    client.addr_len = sizeof(client.addr);
+    client.fd = accept(listen_fd, (sockaddr *)&client.addr, &client.addr_len);
+    client.connected_timestamp = game_clock().hello_now();
+
+    if (client.fd < 0) {
+      if (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR) {
+        print_error("Cannot accept new connection. Errno: " +
+                    to_string(errno));
+      }
+      return;
+    }
+    if (client.set_port_and_ip()) {
+      close(client.fd);
+      return;
+    }
+    Counter *refusal = admission_refusal(client.ip);
+    if (refusal != NULL) {
+      // Nothing was allocated for the client but its address.
+      close(client.fd);
+      refusal->add();
+      continue;
+    }
+    if (fcntl(client.fd, F_SETFL, O_NONBLOCK)) {
+      close(client.fd);
+      print_error("Cannot set client socket to non-blocking mode. Errno: " +
+                  to_string(errno));
+      return;
+    }
+    if (client.addr.ss_family != AF_UNIX) {
+      tune_socket(client.fd);
+    }
 
-  Player client((size_t)k);
-  client.addr_len = sizeof(client.addr);
-  client.fd =
-      accept(listen_pollfd.fd, (sockaddr *)&client.addr, &client.addr_len);
-  client.connected_timestamp = steady_clock::now();
+    add_client(std::move(client));
+  }
+}
 
-  if (client.fd < 0) {
-    print_error("Cannot accept new connection. Errno: " + to_string(errno));
-    return;
+void Server::tune_socket(int fd) {
+  int on = 1;
+  if (low_latency and
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+    print_error("cannot set TCP_NODELAY. errno: " + to_string(errno));
   }
-  if (fcntl(client.fd, F_SETFL, O_NONBLOCK)) {
-    close(client.fd);
-    print_error("Cannot set client socket to non-blocking mode. Errno: " +
+  if (busy_poll_us > 0 and setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                                      &busy_poll_us,
+                                      sizeof(busy_poll_us)) < 0) {
+    // Usually EPERM above net.core.busy_read, it won't work for others.
+    print_error("cannot set SO_BUSY_POLL, disabling it. errno: " +
                 to_string(errno));
-    return;
+    busy_poll_us = 0;
   }
-  if (client.set_port_and_ip()) {
+}
+
+void Server::arm_deadline(TimePoint next_event) {
+  if (next_event == armed_deadline) {
     return;
   }
+  armed_deadline = next_event;
+  // steady_clock is CLOCK_MONOTONIC. A zero time would disarm the timer,
+  // one nanosecond after boot is just as past.
+  int64_t ns = max<int64_t>(
+      1, duration_cast<nanoseconds>(next_event.time_since_epoch()).count());
+  itimerspec spec{};
+  spec.it_value.tv_sec = ns / 1000000000;
+  spec.it_value.tv_nsec = ns % 1000000000;
+  if (timerfd_settime(pollvec[DEADLINE_TIMER].fd, TFD_TIMER_ABSTIME, &spec,
+                      NULL) < 0) {
+    print_error("cannot arm deadline timer. errno: " + to_string(errno));
+  }
+}
+
+Counter *Server::admission_refusal(const string &ip) {
+  if (admission.max_connections != 0 and
+      pollvec.size() - FIRST_CLIENT >= admission.max_connections) {
+    return &stats.shed_connections;
+  }
+  if (admission.max_pre_hello != 0 and pre_hello >= admission.max_pre_hello) {
+    return &stats.shed_pre_hello;
+  }
+  if (admission.max_per_ip != 0) {
+    auto same_ip = clients_per_ip.find(ip);
+    if (same_ip != clients_per_ip.end() and
+        same_ip->second >= admission.max_per_ip) {
+      return &stats.shed_per_ip;
+    }
+  }
+  return NULL;
+}
 
-  cout << "New client [" << client.ip << "]:" << client.port << "." << endl;
+int Server::add_socketpair_client(const string &ip, uint16_t port) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 or
+      fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0 or
+      fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {
+    print_error("cannot create socketpair: " + string(strerror(errno)));
+    return -1;
+  }
+  Player client;
+  client.fd = fds[0];
+  client.addr_len = 0;
+  client.ip = ip;
+  client.port = port;
+  client.connected_timestamp = game_clock().now();
+  add_client(std::move(client));
+  return fds[1];
+}
+
+void Server::add_client(Player &&client) {
+  log_info("New client [" + client.ip + "]:" + to_string(client.port) + ".");
+  client.connection = connections++;
+  ++pre_hello;
+  ++clients_per_ip[client.ip];
+  client.messages_to_send.limits = &output_limits;
+  if (journal.enabled()) {
+    journal.connect(client.connection, client.ip, client.port);
+  }
+  stats.accepts.add();
+  stats.players.add(1);
+  stats.pre_hello.set((int64_t)pre_hello);
 
   pollfd client_fd_struct{};
   client_fd_struct.fd = client.fd;
@@ -582,22 +1012,55 @@ void Server::accept_new_connection() {
   client_fd_struct.revents = 0;
 
   pollvec.add_client(client_fd_struct);
-  players.add_player(client);
+  players.add_player(std::move(client));
+}
+
+void Server::delete_closed() {
+  // From the highest index, so the last client moved into a hole is never
+  // one that is still to be deleted.
+  sort(closed.begin(), closed.end(), greater<size_t>());
+  for (size_t i : closed) {
+    delete_client(i);
+  }
+  closed.clear();
 }
 
 void Server::delete_client(size_t i) {
-  counter_m -= players[i].n_proper_puts;
+  if (players[i].helloed) {
+    auto &room = rooms[players[i].room];
+    room.counter_m -= players[i].n_proper_puts;
+    --room.n_players;
+  } else {
+    --pre_hello;
+    stats.pre_hello.set((int64_t)pre_hello);
+  }
+  auto same_ip = clients_per_ip.find(players[i].ip);
+  if (--same_ip->second == 0) {
+    clients_per_ip.erase(same_ip);
+  }
   pollvec.delete_client(i);
   players.delete_client(i);
+  stats.disconnects.add();
+  stats.players.add(-1);
 }
 
-string Server::make_scoring() {
-  vector<pair<string, double>> scoring;
-  for (size_t i = 1; i < pollvec.size(); ++i) {
-    scoring.push_back({players[i].id, players[i].error});
+vector<const GamePlayer *> Server::room_players(size_t room,
+                                               vector<size_t> &indices) {
+  vector<const GamePlayer *> res;
+  for (size_t i = FIRST_CLIENT; i < pollvec.size(); ++i) {
+    if (players[i].room == room) {
+      res.push_back(&players[i]);
+      indices.push_back(i);
+    }
   }
-  auto comp = [](const auto &a, const auto &b) { return a.first < b.first; };
-  sort(scoring.begin(), scoring.end(), comp);
+  return res;
+}
+
+string Server::make_scoring(size_t room) {
+  TRACE_SCOPE("make_scoring");
+  ALLOC_SCOPE(AllocTag::SCORING);
+  vector<size_t> indices;
+  auto scoring = scores_by_id(room_players(room, indices));
 
   string res = "SCORING";
   for (const auto &i : scoring) {
@@ -608,116 +1071,351 @@ string Server::make_scoring() {
   return res;
 }
 
-void Server::finish_game() {
-  string scoring = make_scoring();
-  cout << "Game end, scoring: " << scoring.substr(8, scoring.size() - 10) << "."
-       << endl;
-  for (size_t i = pollvec.size() - 1; i > 0; --i) {
+// Returns rank (1-based, lowest error first) of every player in the room,
+// indexed like players. The top_n best players are stored in top.
+vector<size_t> Server::rank_players(size_t room,
+                                    vector<pair<string, double>> &top) {
+  vector<size_t> indices;
+  auto in_room = room_players(room, indices);
+  vector<size_t> order = rank_order(in_room);
+
+  vector<size_t> ranks(pollvec.size(), 0);
+  for (size_t r = 0; r < order.size(); ++r) {
+    ranks[indices[order[r]]] = r + 1;
+    if (r < (size_t)top_n) {
+      top.push_back({in_room[order[r]]->id, in_room[order[r]]->error});
+    }
+  }
+  return ranks;
+}
+
+void Server::start_game(size_t room) {
+  rooms[room].counter_m = 0;
+  rooms[room].playing = true;
+  // Players waiting in the room get new coefficients right away.
+  for (size_t i = FIRST_CLIENT; i < pollvec.size(); ++i) {
+    if (players[i].room == room and players[i].helloed) {
+      players[i].send_coeff(rooms[room].file);
+      pollvec[i].events |= POLLOUT;
+    }
+  }
+}
+
+void Server::finish_game(size_t room) {
+  TRACE_SCOPE("finish_game");
+  ALLOC_SCOPE(AllocTag::SCORING);
+  // The full table is only logged here, compact clients get just the top.
+  string scoring = make_scoring(room);
+  log_info("Game end, scoring: " + scoring.substr(8, scoring.size() - 10) +
+           ".");
+  if (low_latency) {
+    const Histogram &lateness = stats.send_lateness_us;
+    log_info("Send lateness: p50 " + to_string(lateness.quantile(0.5)) +
+             " us, p99 " + to_string(lateness.quantile(0.99)) + " us, max " +
+             to_string(lateness.quantile(1)) + " us.");
+  }
+
+  vector<pair<string, double>> top;
+  vector<size_t> ranks = rank_players(room, top);
+
+  for (size_t i = pollvec.size() - 1; i >= FIRST_CLIENT; --i) {
     auto &client = players[i];
-    client.send_scoring(scoring);
+    if (client.room != room) {
+      continue;
+    }
+    if (client.compact_scoring) {
+      client.send_scoring(make_compact_scoring(ranks[i], client.error, top));
+    } else {
+      client.send_scoring(scoring);
+    }
+    if (lobby) {
+      // The connection stays open, the rest of the scoring is sent later.
+      client.reset_game();
+      continue;
+    }
     if (client.messages_to_send.currently_sending()) {
       print_error("could not send whole sconring to " +
                   client.to_string_w_id() + ".");
     }
     delete_client(i);
   }
-}
-
-void Server::play_a_game() {
-  counter_m = 0;
-  TimePoint next_event = steady_clock::now() + seconds(1);
 
-  while (counter_m < m) {
-    int timeout = max(0, (int)time_diff(steady_clock::now(), next_event));
+  rooms[room].playing = false;
+  rooms[room].counter_m = 0;
+  rooms[room].detached.clear();  // Too late to reattach to this game.
+  // Without the lobby there is a 1 second break before the next game.
+  rooms[room].next_game = game_clock().now() + seconds(lobby ? 0 : 1);
 
-    int poll_status =
-        poll(pollvec.pollfds.data(), (nfds_t)pollvec.size(), timeout);
+  if (!trace_path.empty()) {
+    trace_dump(trace_path);
+  }
+}
 
-    if (poll_status < 0) {
-      print_error("Poll error occurred. errno: " + to_string(errno) + ".");
+TimePoint Server::start_waiting_rooms(TimePoint next_event) {
+  for (size_t r = 0; r < rooms.size(); ++r) {
+    if (rooms[r].playing) {
       continue;
     }
-    // Poll status >= 0.
-    // I can have some events POLLIN or POLLOUT.
-    // I can also have timeout due to a messege I'm supposed to send right now.
+    if (rooms[r].next_game <= game_clock().now()) {
+      start_game(r);
+    } else {
+      next_event = min(next_event, rooms[r].next_game);
+    }
+  }
+  return next_event;
+}
+
+TimePoint Server::checkpoint(TimePoint next_event) {
+  if (checkpoint_path.empty()) {
+    return next_event;
+  }
+  if (checkpoint_pid > 0 and waitpid(checkpoint_pid, NULL, WNOHANG) != 0) {
+    checkpoint_pid = -1;  // Previous checkpoint is written.
+  }
+  auto now = game_clock().now();
+  if (now < next_checkpoint) {
+    return min(next_event, next_checkpoint);
+  }
+  if (checkpoint_pid > 0) {
+    // The previous one is still being written, I try again soon.
+    return min(next_event, now + milliseconds(10));
+  }
 
-    TimePoint new_next_event = steady_clock::now() + seconds(1);
+  // The child gets a copy-on-write snapshot of the game, so the game loop
+  // only pays for the fork.
+  TRACE_SCOPE("checkpoint_fork");
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(write_checkpoint(*this, checkpoint_path) < 0 ? 1 : 0);
+  }
+  if (pid < 0) {
+    print_error("cannot fork checkpoint writer. errno: " + to_string(errno));
+  }
+  checkpoint_pid = pid;
+  next_checkpoint = now + checkpoint_interval;
+  return min(next_event, next_checkpoint);
+}
 
-    // First I accept new connection. (if there is any)
-    accept_new_connection();
-    pollvec[0].revents = 0;
+void Server::run() {
+  next_deadline = start_waiting_rooms(TimePoint::max());
+  TimePoint next_event = min(next_deadline, game_clock().now() + seconds(1));
+  while (!stop_requested) {
+    next_event = run_once(next_event);
+  }
+}
 
-    for (size_t i = 1; i < pollvec.size(); ++i) {
-      auto &pollfd = pollvec[i];
-      auto &client = players[i];
-      pollfd.events = POLLIN;  // Reset events to POLLIN for the next poll
+TimePoint Server::run_once(TimePoint next_event) {
+  GameClock &clock = game_clock();
+  int timeout = max(0, (int)time_diff(clock.now(), next_event));
+  if (clock.mode != ClockMode::REAL) {
+    // Only clients wake a virtual clock, unless something is due already.
+    bool quiet_wait = clock.mode == ClockMode::VIRTUAL and !spin and
+                      clock.now() < next_event;
+    timeout = quiet_wait ? (int)VIRTUAL_QUIET.count() : 0;
+  } else if (spin) {
+    timeout = 0;
+  } else if (pollvec[DEADLINE_TIMER].fd >= 0) {
+    arm_deadline(next_event);
+    timeout = -1;  // The timer ends the poll.
+  }
 
-      if ((pollfd.revents & (POLLIN | POLLERR))) {
-        // read
-        ssize_t read_len = read(pollfd.fd, buffer.data(), buff_len);
+  int poll_status;
+  {
+    TRACE_SCOPE("poll");
+    poll_status = poll(pollvec.pollfds.data(), (nfds_t)pollvec.size(), timeout);
+  }
 
-        if (read_len < 0) {
-          print_error("Reading message from " + client.ip + ":" +
-                      to_string(client.port) +
-                      " result in error. Closing connection");
-          delete_client(i);
-          --i;
-          continue;
-        } else if (read_len == 0) {
-          cout << "Player " << client.to_string_w_id() << " disconnected."
-               << endl;
-          delete_client(i);
-          --i;
-          continue;
-        } else {
-          string pom = buffer.substr(0, (size_t)read_len);
-          int read_res = client.read_message(pom, file);
-          if (read_res == -1) {
-            delete_client(i);
-            --i;
-            continue;
-          } else if (read_res == 1) {
-            // A proper PUT was made.
-            ++counter_m;
-            if (counter_m == m) {
-              finish_game();
-              return;
-            }
+  if (metrics_dump_requested) {
+    metrics_dump_requested = 0;
+    string dump = metrics().dump();
+    dump.pop_back();  // log_error adds the newline
+    log_error(dump);
+    if (!trace_path.empty()) {
+      trace_dump(trace_path);
+    }
+  }
+  if (poll_status < 0) {
+    if (errno != EINTR) {
+      print_error("Poll error occurred. errno: " + to_string(errno) + ".");
+    }
+    return next_event;
+  }
+  if (poll_status == 0 and clock.mode == ClockMode::VIRTUAL and
+      pre_hello == 0 and next_deadline != TimePoint::max()) {
+    // Nobody has anything to say until the next deadline, so it is now.
+    // Not while a connection may still send HELLO in real time.
+    clock.advance(next_deadline);
+  }
+  // Poll status >= 0.
+  // I can have some events POLLIN or POLLOUT.
+  // I can also have timeout due to a messege I'm supposed to send right now.
+
+  TimePoint iteration_start = steady_clock::now();  // For the metric
+  TimePoint now = game_clock().now();
+  TimePoint hello_now = game_clock().hello_now();
+  TimePoint new_next_event = TimePoint::max();  // Deadlines only
+  int64_t queued_messages = 0, max_queued_messages = 0;
+  int64_t queued_bytes = 0, max_queued_bytes = 0, buffered_input_bytes = 0;
+
+  // First I accept new connections. (if there are any)
+  for (size_t listener = 0; listener < N_LISTENERS; ++listener) {
+    accept_new_connection(listener);
+    pollvec[listener].revents = 0;
+  }
+  if (pollvec[DEADLINE_TIMER].revents & POLLIN) {
+    uint64_t expirations;
+    if (read(pollvec[DEADLINE_TIMER].fd, &expirations, sizeof(expirations)) <
+        0) {
+      print_error("cannot read deadline timer. errno: " + to_string(errno));
+    }
+    armed_deadline = TimePoint();  // Expired, the same deadline needs arming
+  }
+  pollvec[DEADLINE_TIMER].revents = 0;
+
+  // Every iteration starts with the next client, so none of them is always
+  // the first to get its PUTs in (or the last PUT of a game). Clients are
+  // deleted after the loop, deleting moves the last one into the hole.
+  size_t n_clients = pollvec.size() - FIRST_CLIENT;
+  size_t first = n_clients == 0 ? 0 : round_robin++ % n_clients;
+  for (size_t visited = 0; visited < n_clients; ++visited) {
+    size_t i = FIRST_CLIENT + (first + visited) % n_clients;
+    auto &pollfd = pollvec[i];
+    auto &client = players[i];
+    pollfd.events = 0;  // Set again for the next poll below
+
+    // Once the last PUT of a game is in, the rest of its room is read after
+    // the game is finished.
+    bool game_ended = client.helloed and
+                      rooms[client.room].counter_m >= rooms[client.room].m;
+    if (!game_ended and
+        (client.pending_lines or (pollfd.revents & (POLLIN | POLLERR)))) {
+      // read
+      ssize_t read_len = 0;
+      if (!client.pending_lines) {
+        TRACE_SCOPE("read");
+        read_len = read(pollfd.fd, buffer.data(), buff_len);
+
+        if (journal.enabled()) {
+          if (read_len > 0) {
+            journal.data(client.connection, buffer.data(), (size_t)read_len);
+          } else {
+            journal.close(client.connection);
           }
         }
       }
-      if ((pollfd.revents & POLLOUT)) {
-        while (client.has_ready_message_to_send()) {
-          if (client.send_message() != 1) {
-            // It reutns 1 iff the whole message was sent.
-            break;
+
+      if (read_len < 0) {
+        print_error("Reading message from " + client.ip + ":" +
+                    to_string(client.port) +
+                    " result in error. Closing connection");
+        closed.push_back(i);
+        continue;
+      } else if (read_len == 0 and !client.pending_lines) {
+        log_info("Player " + client.to_string_w_id() + " disconnected.");
+        closed.push_back(i);
+        continue;
+      } else {
+        stats.bytes_in.add((uint64_t)read_len);
+        bool was_helloed = client.helloed;
+        int read_res = client.read_message(
+            string_view(buffer.data(), (size_t)read_len), rooms);
+        if (!was_helloed and client.helloed) {
+          --pre_hello;
+          stats.pre_hello.set((int64_t)pre_hello);
+        }
+        if (read_res == -1) {
+          closed.push_back(i);
+          continue;
+        } else if (read_res == 1) {
+          // A proper PUT was made.
+          auto &room = rooms[client.room];
+          ++room.counter_m;
+          if (room.counter_m == room.m) {
+            // Finishing deletes players, so it waits until the loop is
+            // done with them.
+            ended.push_back(client.room);
           }
         }
       }
-      pollfd.revents = 0;
-
-      if (!client.helloed) {
-        if (client.connected_timestamp + seconds(3) <= steady_clock::now()) {
-          // Player didnt send HELLO in 3 seconds.
-          delete_client(i);
-          --i;
-          continue;
+    }
+    if ((pollfd.revents & POLLOUT) or
+        (low_latency and client.has_ready_message_to_send())) {
+      size_t budget_end = client.messages_to_send.queued_bytes > WRITE_BUDGET
+                              ? client.messages_to_send.queued_bytes -
+                                    WRITE_BUDGET
+                              : 0;
+      while (client.has_ready_message_to_send() and
+             client.messages_to_send.queued_bytes > budget_end) {
+        if (client.send_message() != 1) {
+          // It reutns 1 iff the whole message was sent.
+          break;
         }
       }
+    }
+    pollfd.revents = 0;
 
-      if (!client.messages_to_send.empty()) {
-        if (client.has_ready_message_to_send()) {
-          // If there are messages to send, set POLLOUT
-          pollfd.events |= POLLOUT;
-        }
-        pollfd.events |= POLLOUT;  // Set POLLOUT if there are messages to send
-        new_next_event = min(
-            new_next_event,
-            client.messages_to_send.get_ready_time()  // First message to send
-        );
+    if (client.messages_to_send.overflowed) {
+      log_info("Player " + client.to_string_w_id() +
+               " does not read its replies, disconnecting.");
+      stats.slow_consumer_disconnects.add();
+      closed.push_back(i);
+      continue;
+    }
+
+    if (!client.helloed) {
+      if (client.connected_timestamp + HELLO_TIMEOUT <= hello_now) {
+        // Player didnt send HELLO in 3 seconds.
+        closed.push_back(i);
+        continue;
+      }
+      if (game_clock().mode != ClockMode::VIRTUAL) {
+        // A virtual clock polls every millisecond while it waits for HELLO.
+        new_next_event =
+            min(new_next_event, client.connected_timestamp + HELLO_TIMEOUT);
       }
     }
 
-    next_event = new_next_event;
+    int64_t queued = (int64_t)client.messages_to_send.messages.size() +
+                     client.messages_to_send.currently_sending();
+    queued_messages += queued;
+    max_queued_messages = max(max_queued_messages, queued);
+    buffered_input_bytes += (int64_t)client.buffered_message.size();
+    queued = (int64_t)client.messages_to_send.queued_bytes;
+    queued_bytes += queued;
+    max_queued_bytes = max(max_queued_bytes, queued);
+
+    if (client.pending_lines) {
+      // Nothing more is read until the lines are handled, right after the
+      // next poll.
+      new_next_event = now;
+    } else {
+      pollfd.events = POLLIN;
+    }
+    if (client.has_ready_message_to_send()) {
+      pollfd.events |= POLLOUT;
+    } else if (!client.messages_to_send.empty()) {
+      // Delayed messages: the poll times out when the first one is due.
+      new_next_event = min(new_next_event,
+                           client.messages_to_send.get_ready_time());
+    }
   }
-}
\ No newline at end of file
+  delete_closed();
+  for (size_t room : ended) {
+    finish_game(room);
+    new_next_event = now;  // The rest of the room is read right away.
+  }
+  ended.clear();
+
+  next_deadline = checkpoint(start_waiting_rooms(new_next_event));
+  next_event = min(next_deadline, now + seconds(1));
+  journal.flush();
+
+  stats.queued_messages.set(queued_messages);
+  stats.max_queued_messages.set(max_queued_messages);
+  stats.queued_bytes.set(queued_bytes);
+  stats.max_queued_bytes.set(max_queued_bytes);
+  stats.buffered_input_bytes.set(buffered_input_bytes);
+  stats.loop_iteration_us.record(
+      micros_since(iteration_start, steady_clock::now()));
+  return next_event;
+}
@@ -3,58 +3,232 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <fstream>
 #include <iostream>
 #include <queue>
+#include <unordered_map>
 #include <vector>
 
+#include "../common/alloc.hpp"
+#include "../common/log.hpp"
+#include "../common/metrics.hpp"
+#include "../common/trace.hpp"
 #include "../common/utils.hpp"
+#include "game-engine.hpp"
+#include "journal.hpp"
 
 using namespace std;
 using namespace std::chrono;
 
 int ipv6_enabled_sock(uint16_t port);
 int ipv4_only_sock(uint16_t port);
+// Listening AF_UNIX stream socket at path, a stale socket file is replaced
+// but any other file at path is an error.
+int unix_sock(const string& path);
+
+// HELLO <id>[ <option>...]\r\n, options turn on optional protocol features.
+constexpr const char* COMPACT_OPTION = "COMPACT";  // SCORING_TOP at game end
+constexpr const char* ROOM_OPTION = "ROOM=";       // ROOM=<r> picks a room
+
+// Longest lines a client may send, longer ones are not kept. Points and
+// values may have any number of leading zeros, so no PUT is too long for the
+// grammar: a longer one gets BAD_PUT with the arguments cut short.
+constexpr size_t MAX_HELLO_LENGTH = 1024;
+constexpr size_t MAX_PUT_LENGTH = 1024;
+// A PUT over MAX_PUT_LENGTH, kept as its first bytes without "\r\n".
+bool is_oversize_put(const string& msg);
+// pollfds (and dummy players) before FIRST_CLIENT: the listening sockets
+// and the deadline timer of the low-latency mode.
+constexpr size_t N_LISTENERS = 2, DEADLINE_TIMER = 2, FIRST_CLIENT = 3;
+// Clients that do not send HELLO in time are disconnected.
+constexpr seconds HELLO_TIMEOUT{3};
+// Most connections accepted per poll.
+constexpr int ACCEPT_BATCH = 32;
+// Work done for one client per loop iteration, so a client with a burst of
+// pipelined PUTs does not delay everyone after it. Reads are bounded by the
+// buffer, one read of at most Server::buff_len bytes.
+constexpr size_t MESSAGE_BUDGET = 16;      // Lines handled
+constexpr size_t WRITE_BUDGET = 1 << 16;  // Bytes written
 
 bool proper_hello(const string& msg);
 string id_from_hello(const string& msg);
-// returns number of small letters in the id
-size_t get_no_small_letters(const string& str);
+vector<string> hello_options(const string& msg);
+// returns the room requested in HELLO, -1 if any room is fine
+int64_t room_from_hello(const string& msg);
 
 string make_penalty(const string& point, const string& value);
 string make_bad_put(const string& point, const string& value);
 string make_coeff(ifstream& file);
 string make_state(const vector<double>& approx);
+// SCORING_TOP <rank> <error>[ <id> <error>...]\r\n with the top players.
+string make_compact_scoring(size_t rank, double error,
+                            const vector<pair<string, double>>& top);
 
 bool is_integer(const string& str);
 
 tuple<string, string> get_point_and_value(const string& msg);
+// The arguments of an oversize PUT as far as they were kept.
+tuple<string, string> get_oversize_point_and_value(const string& msg);
 bool is_put(const string& msg);
 
-// This function assumes that the message is a PUT message checked by is_put.
-bool is_bad_put(const string& point, const string& value, int32_t k);
-
 using TimePoint = steady_clock::time_point;
-using Msg = std::pair<TimePoint, string>;
+struct Msg {
+  TimePoint ready;   // The message is not sent before that
+  TimePoint queued;  // When the message was queued
+  uint64_t seq;      // Messages ready at the same time keep their order
+  string text;
+};
 struct MsgComparator {
   bool operator()(const Msg& a, const Msg& b) const {
-    return a.first > b.first;
+    return a.ready > b.ready or (a.ready == b.ready and a.seq > b.seq);
+  }
+};
+// The clock of the game: reply delays, the HELLO timeout, breaks between
+// games and checkpoints. REAL is steady_clock. VIRTUAL starts at the
+// steady_clock time it is set and moves only forward: run_once jumps to the
+// next deadline once the clients are quiet. MANUAL does not move by itself,
+// its owner (approx-replay) advances it.
+enum class ClockMode { REAL, VIRTUAL, MANUAL };
+
+struct GameClock {
+  ClockMode mode = ClockMode::REAL;
+  TimePoint virtual_now;
+
+  void set_mode(ClockMode _mode);
+  TimePoint now() const {
+    return mode == ClockMode::REAL ? steady_clock::now() : virtual_now;
+  }
+  // Moves a virtual clock forward to t, never back.
+  void advance(TimePoint t);
+  // Clock of the HELLO timeout. A virtual clock jumps between deadlines of
+  // the game, so connections that did not send HELLO stay on steady_clock.
+  TimePoint hello_now() const {
+    return mode == ClockMode::VIRTUAL ? steady_clock::now() : now();
   }
 };
+GameClock& game_clock();
+// How long run_once waits for clients before a virtual clock jumps.
+constexpr milliseconds VIRTUAL_QUIET{1};
+
 inline auto time_diff(TimePoint begin, TimePoint end) {
   return duration_cast<milliseconds>(end - begin).count();
 }
+inline uint64_t micros_since(TimePoint begin, TimePoint end) {
+  if (end <= begin) {
+    return 0;
+  }
+  return (uint64_t)duration_cast<microseconds>(end - begin).count();
+}
+
+struct ServerMetrics {
+  MetricsRegistry& registry = metrics();
+  Counter& accepts = registry.counter("approx_accepts_total",
+                                      "Accepted connections.");
+  Counter& disconnects = registry.counter("approx_disconnects_total",
+                                          "Closed client connections.");
+  Counter& bytes_in =
+      registry.counter("approx_bytes_in_total", "Bytes read from clients.");
+  Counter& bytes_out =
+      registry.counter("approx_bytes_out_total", "Bytes written to clients.");
+  Counter& puts = registry.counter("approx_puts_total", "PUT messages.");
+  Counter& penalties =
+      registry.counter("approx_penalties_total", "PUTs sent before a reply.");
+  Counter& bad_puts = registry.counter(
+      "approx_bad_puts_total", "PUTs with point or value out of range.");
+  Gauge& players = registry.gauge("approx_players", "Connected clients.");
+  Gauge& queued_messages = registry.gauge(
+      "approx_queued_messages", "Messages waiting to be sent to all clients.");
+  Gauge& max_queued_messages =
+      registry.gauge("approx_max_queued_messages",
+                     "Most messages waiting to be sent to one client.");
+  Gauge& queued_bytes = registry.gauge(
+      "approx_queued_bytes", "Bytes waiting to be sent to all clients.");
+  Gauge& max_queued_bytes =
+      registry.gauge("approx_max_queued_bytes",
+                     "Most bytes waiting to be sent to one client.");
+  Counter& oversize_lines = registry.counter(
+      "approx_oversize_lines_total",
+      "Lines longer than any legal message, dropped unparsed.");
+  Gauge& buffered_input_bytes = registry.gauge(
+      "approx_buffered_input_bytes",
+      "Bytes of unfinished lines kept for all clients.");
+  Gauge& pre_hello = registry.gauge("approx_pre_hello_clients",
+                                    "Connected clients without HELLO.");
+  Counter& shed_connections = registry.counter(
+      "approx_shed_connections_total",
+      "Connections closed at accept, over the connection limit.");
+  Counter& shed_pre_hello = registry.counter(
+      "approx_shed_pre_hello_total",
+      "Connections closed at accept, over the pre-HELLO limit.");
+  Counter& shed_per_ip = registry.counter(
+      "approx_shed_per_ip_total",
+      "Connections closed at accept, over the limit of their IP.");
+  Counter& coalesced_states = registry.counter(
+      "approx_coalesced_states_total",
+      "Queued STATE messages dropped for a newer one of the same client.");
+  Counter& slow_consumer_disconnects = registry.counter(
+      "approx_slow_consumer_disconnects_total",
+      "Clients disconnected because their output exceeded the caps.");
+  Histogram& reply_latency_us = registry.histogram(
+      "approx_reply_latency_us",
+      "Time from receiving a message (e.g. PUT) to writing the whole reply, "
+      "including the intended delay.");
+  Histogram& send_lateness_us = registry.histogram(
+      "approx_send_lateness_us",
+      "Time from when a delayed message was due to when it started being "
+      "sent.");
+  Histogram& loop_iteration_us = registry.histogram(
+      "approx_loop_iteration_us", "Time spent handling one poll result.");
+};
+ServerMetrics& server_metrics();
+
+// Set by the SIGUSR1 handler, metrics are dumped to stderr (and the trace to
+// its file) by the event loop.
+extern volatile sig_atomic_t metrics_dump_requested;
+// Set by the SIGINT and SIGTERM handlers, run returns so the log and the
+// journal are flushed.
+extern volatile sig_atomic_t stop_requested;
+
+// What happens when the output of a client exceeds the caps: it is
+// disconnected, or first its queued STATEs are dropped for the newest one.
+enum class OutputPolicy { DISCONNECT, COALESCE };
+
+// Caps of the output queued for one client, 0 is no cap.
+struct OutputLimits {
+  size_t max_bytes = 0;
+  size_t max_messages = 0;
+  OutputPolicy policy = OutputPolicy::DISCONNECT;
+};
+
+// Limits checked when a connection is accepted, 0 is no limit.
+struct AdmissionLimits {
+  size_t max_connections = 0;
+  size_t max_pre_hello = 0;  // Connections that did not send HELLO yet
+  size_t max_per_ip = 0;
+};
 
 struct MessageQueue {
   priority_queue<Msg, vector<Msg>, MsgComparator> messages;
   size_t current_pos = 0;
   string current_message;
+  TimePoint current_queued;  // When current_message was queued
+  uint64_t pushed = 0;
+  size_t queued_bytes = 0;  // Not sent yet, including current_message
+  const OutputLimits* limits = NULL;
+  // A message did not fit in the caps and was dropped, the client has to be
+  // disconnected.
+  bool overflowed = false;
 
   void push(const string& msg, uint64_t delay_s);
+  // Drops the messages that are not being sent.
+  void clear_waiting();
   void get_current();
   bool currently_sending() const;
   bool empty() const;
@@ -63,44 +237,98 @@ struct MessageQueue {
   int send_message(int socket_fd);
   TimePoint get_ready_time() const;
   void send_scoring(const string& scoring, int socket_fd);
+
+ private:
+  bool exceeds_limits(size_t msg_size) const;
+  // Drops the waiting STATE messages, returns how many.
+  size_t drop_states();
 };
 
-struct Player {
+// State of a player restored from a checkpoint, waiting for the player to
+// reattach with HELLO.
+struct PlayerSnapshot {
+  string id;
+  int32_t n_proper_puts = 0;
+  double error = 0.0;
+  vector<double> approx;
+  vector<double> goal;
+  string coeff;  // COEFF message the player got
+};
+
+// A room runs its own games with its own parameters and coefficients file.
+// All rooms share the server's sockets and event loop.
+constexpr size_t NO_ROOM = SIZE_MAX;  // Room of a player before HELLO
+struct Room {
+  int32_t k, n;
+  int32_t m, counter_m = 0;
+  string filename;
+  ifstream file;
+  size_t n_players = 0;  // Number of helloed players assigned to the room
+  bool playing = false;
+  TimePoint next_game;  // When the next game starts if not playing
+  vector<PlayerSnapshot> detached;  // Checkpointed players not back yet
+
+  Room(int32_t _k, int32_t _n, int32_t _m, const string& _filename)
+      : k(_k), n(_n), m(_m), filename(_filename) {}
+};
+
+// Connection of a player, the game state itself is in GamePlayer.
+struct Player : GamePlayer {
   int fd;                   // File descriptor for the client socket
   sockaddr_storage addr{};  // Address of the client
   socklen_t addr_len;       // Length of the address structure
 
-  string id = "UNKNOWN";
-  size_t n_small_letters = 0;  // Number of small letters in the id
   string buffered_message;
   bool started_before_reply = 0;
-
-  string reply_buffer;   // Buffer for the reply to the client
-  size_t reply_pos = 0;  // Position in the reply buffer
+  // The rest of an oversize line is dropped up to its "\r\n", meanwhile
+  // buffered_message keeps only a trailing "\r".
+  bool discarding = false;
+  // buffered_message starts with complete lines left over by MESSAGE_BUDGET,
+  // they are handled before anything more is read.
+  bool pending_lines = false;
+  // Set when a lobby game ends: until the COEFF of the next game is sent,
+  // whatever the player sends was meant for the previous game and is dropped.
+  bool stale_input = false;
 
   bool helloed = 0;
+  bool compact_scoring = 0;  // Player asked for SCORING_TOP in HELLO
+  size_t room = NO_ROOM;     // Set by HELLO
 
   MessageQueue messages_to_send;
-  string current_message;
-  size_t current_message_pos = 0;
 
   string ip;
   uint16_t port;
 
-  int32_t n_proper_puts = 0;
-
   TimePoint connected_timestamp;
+  uint64_t connection = 0;  // Number of the connection in the journal
 
-  vector<double> approx;
-  vector<double> goal;
-  double error = 0.0;
-
-  Player(size_t k) : approx(k + 1, 0.0) {}
+  string coeff_message;  // COEFF message of the current game
 
   int set_port_and_ip();
+  // The longest line the player may send now: HELLO, then PUTs.
+  size_t max_line_length() const;
+  // Adds the first max_length bytes of the oversize line at start of
+  // buffered_message to messages if it is a PUT, so it gets BAD_PUT.
+  void keep_oversize_put(size_t start, size_t max_length,
+                         vector<string>& messages) const;
   // returns: -1 iff we should disconnect the client, 1 iff a proper put was
   // made, 0 otherwise
-  int read_message(const string& msg, ifstream& file);
+  int read_message(string_view msg, vector<Room>& rooms);
+  // Applies a PUT (checked by is_put or is_oversize_put) and queues the
+  // replies. With bad_is_early a bad PUT is early too and gets PENALTY, as
+  // bad PUTs after the first line of a read always did.
+  // returns 1 iff it was a proper put
+  int handle_put(const string& msg, bool early, bool bad_is_early = false);
+  // Puts the player in the requested room or in the one with fewest players.
+  // returns -1 iff there is no such room
+  int join_room(int64_t requested, vector<Room>& rooms);
+  // Restores the state saved in a checkpoint under the player's id.
+  // returns false iff there is no such state
+  bool reattach(vector<Room>& rooms);
+  // Sends next coefficients from the file and sets the goal.
+  void send_coeff(ifstream& file);
+  // Prepares a lobby player for the next game on the same connection.
+  void reset_game();
 
   bool has_ready_message_to_send() const;
   // Returns: -1 iff error, 1 iff the whole message was sent, 0 otherwise
@@ -109,29 +337,32 @@ struct Player {
   string to_string_wo_id();
   void print_error_bad_message(const string& msg);
   void send_scoring(const string& scoring);
-  void calc_goal_from_coef(string& coeff);
-  void update_approximation(const string& point, const string& value);
 };
 
 struct PlayerSet {
   vector<Player> players;
 
-  PlayerSet() : players(1, 0) {}  // Because pollfd[0] is the listening socket
+  PlayerSet() : players(FIRST_CLIENT) {}  // For the listening sockets etc.
 
   void delete_client(size_t i);
   Player& operator[](size_t i);
-  void add_player(const Player& client);
+  void add_player(Player&& client);
 };
 
 struct Pollvec {
-  // 0-th polldf is always the listening socket.
+  // 0-th pollfd is always the TCP listening socket, 1st is the AF_UNIX one
+  // and 2nd the timerfd of deadlines (fd -1 if there is none, poll skips it).
   // Other pollfds are clients.
   vector<pollfd> pollfds;
   uint16_t listen_port;
+  string unix_path;             // No AF_UNIX socket if empty
+  bool deadline_timer = false;  // Create the timerfd
   Pollvec(uint16_t _listen_port) : listen_port(_listen_port) {};
   ~Pollvec() {
     for (const auto& pfd : pollfds) {
-      close(pfd.fd);
+      if (pfd.fd >= 0) {
+        close(pfd.fd);
+      }
     }
   }
 
@@ -146,26 +377,79 @@ struct Pollvec {
 struct Server {
   Pollvec pollvec;
   PlayerSet players;
-  int32_t k, n;
-  int32_t m, counter_m = 0;
-  char* filename;
-  ifstream file;
+  vector<Room> rooms;
+  int32_t top_n;  // Number of players sent in SCORING_TOP
+  bool lobby;     // Connections are kept open between games
   const size_t buff_len = 5000;
   string buffer;
 
-  Server(uint16_t _listen_port, int32_t _k, int32_t _n, int32_t _m,
-         char* _filename)
+  string checkpoint_path;  // Empty iff checkpoints are disabled
+  string trace_path;       // Where the trace is dumped, may be empty
+  milliseconds checkpoint_interval{1000};
+  TimePoint next_checkpoint;
+  pid_t checkpoint_pid = -1;  // Child process writing the last checkpoint
+  JournalWriter journal;      // Not enabled unless opened
+  OutputLimits output_limits;
+  AdmissionLimits admission;
+  uint64_t connections = 0;  // Accepted so far
+  // Low-latency mode: poll sleeps until a timerfd deadline (nanoseconds, not
+  // the milliseconds of its timeout), client sockets get TCP_NODELAY and due
+  // messages are written without waiting for POLLOUT.
+  bool low_latency = false;
+  int busy_poll_us = 0;  // SO_BUSY_POLL of client TCP sockets, 0 is off
+  bool spin = false;     // Poll without sleeping, best on a pinned core
+  TimePoint armed_deadline;
+  // Earliest delayed message, game start or checkpoint, where a virtual
+  // clock may jump. Unlike next_event it has no 1 second tick.
+  TimePoint next_deadline = TimePoint::max();
+  size_t round_robin = 0;  // The client visited first by run_once
+  vector<size_t> closed;   // Clients run_once deletes after its loop
+  vector<size_t> ended;    // Rooms whose games run_once finishes after it
+  size_t pre_hello = 0;      // Clients that did not send HELLO yet
+  unordered_map<string, size_t> clients_per_ip;
+
+  ServerMetrics& stats = server_metrics();
+
+  Server(uint16_t _listen_port, int32_t _top_n, bool _lobby)
       : pollvec(_listen_port),
-        k(_k),
-        n(_n),
-        m(_m),
-        filename(_filename),
+        top_n(_top_n),
+        lobby(_lobby),
         buffer(buff_len, '\0') {}
 
+  void add_room(int32_t k, int32_t n, int32_t m, const string& filename);
   int set_up();
-  void accept_new_connection();
+  // Accepts waiting connections on pollvec[listener], a bounded number per
+  // call, and closes right away those over the admission limits.
+  void accept_new_connection(size_t listener);
+  // returns the counter of the admission limit a new client from ip
+  // exceeds, NULL if it is admitted
+  Counter* admission_refusal(const string& ip);
+  // Sets the low-latency options of an accepted TCP socket.
+  void tune_socket(int fd);
+  // Sets the timerfd to wake poll at next_event.
+  void arm_deadline(TimePoint next_event);
+  // Adds a connected (non-blocking) client whose ip and port are set.
+  void add_client(Player&& client);
+  // Adds a client connected over a socketpair, for drivers that run the
+  // server in their own process (approx-replay, approx-test).
+  // returns the client's end of the pair, -1 on error
+  int add_socketpair_client(const string& ip, uint16_t port);
   void delete_client(size_t i);
-  string make_scoring();
-  void finish_game();
-  void play_a_game();
+  // Deletes the clients in closed.
+  void delete_closed();
+  // Players in the room and their indices in players.
+  vector<const GamePlayer*> room_players(size_t room, vector<size_t>& indices);
+  string make_scoring(size_t room);
+  vector<size_t> rank_players(size_t room, vector<pair<string, double>>& top);
+  void start_game(size_t room);
+  void finish_game(size_t room);
+  // Starts games in rooms whose break is over, returns the next start time.
+  TimePoint start_waiting_rooms(TimePoint next_event);
+  // Writes a checkpoint in a forked child if it is time for one, returns
+  // the time of the next checkpoint.
+  TimePoint checkpoint(TimePoint next_event);
+  // Polls until next_event at the latest and handles what happened.
+  // returns the time of the next event
+  TimePoint run_once(TimePoint next_event);
+  void run();
 };
\ No newline at end of file